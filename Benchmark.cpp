@@ -0,0 +1,616 @@
+// runs every lab on seeded generated workloads and reports throughput, latency percentiles
+// and peak resident memory, either as text or as JSON for tracking regressions
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <array>
+#include <string>
+#include <utility>
+#include <tuple>
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <set>
+#include <queue>
+#include <deque>
+#include <memory>
+#include <bitset>
+#include <unordered_map>
+#include <unordered_set>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "Instrumentation.h"
+
+// every lab is compiled into its own namespace, so that their globals don't collide;
+// the headers above are already included, so the includes of the labs add nothing to the namespaces
+#define FLPC_NO_MAIN
+namespace lab1_1 {
+#include "Lab1.1.cpp"
+}
+namespace lab1_2 {
+#include "Lab1.2.cpp"
+}
+namespace lab2_1 {
+#include "Lab2.1.cpp"
+}
+// the command line routines of Lab2.2 are not called here
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+namespace lab2_2 {
+#include "Lab2.2Parser.cpp"
+}
+#pragma GCC diagnostic pop
+namespace lab3 {
+#include "Lab3.cpp"
+}
+using namespace std;
+
+
+// measurements of a single workload
+struct BenchmarkResult {
+    string name;
+    // what the throughput is counted in, e.g. bytes or symbols
+    string unit;
+    // units processed by every iteration
+    double work = 0;
+    // milliseconds spent by every iteration
+    vector<double> latencies;
+    long peak_rss_kb = 0;
+    // false when two implementations which should agree did not
+    bool consistent = true;
+};
+
+// set by the command line
+unsigned benchmark_seed = 2024;
+int benchmark_iterations = 10;
+int benchmark_scale = 1;
+vector<string> only_prefixes;
+
+vector<BenchmarkResult> results;
+
+
+// workloads, each generates its input from the seed and appends its results
+static void benchmark_lab1_1(mt19937 &random);
+static void benchmark_lab1_2(mt19937 &random);
+static void benchmark_lab2_1(mt19937 &random);
+static void benchmark_lab2_2(mt19937 &random);
+static void benchmark_lab2_2_evaluation(mt19937 &random, int jobs);
+static void benchmark_lab3(mt19937 &random);
+
+// measurement routines
+static bool is_selected(const string &name);
+static double elapsed_since(chrono::steady_clock::time_point started);
+static BenchmarkResult& measure(const string &name, const string &unit, const function<double()> &iteration);
+static double percentile(vector<double> sorted, double fraction);
+static void print_results_as_text();
+static void print_results_as_json();
+
+
+int main(int argc, char **argv) {
+    bool as_json = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            as_json = true;
+        } else if (strcmp(argv[i], "--seed") == 0 && i+1 < argc) {
+            benchmark_seed = (unsigned)strtoul(argv[++i], nullptr, 10);
+        } else if ((strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "--iterations") == 0) && i+1 < argc) {
+            benchmark_iterations = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--scale") == 0 && i+1 < argc) {
+            benchmark_scale = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--only") == 0 && i+1 < argc) {
+            only_prefixes.emplace_back(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--json] [--seed N] [--iterations N] [--scale N] [--only PREFIX]...\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    // every workload has its own generator, so selecting some of them doesn't change the others
+    const vector<pair<const char *, void (*)(mt19937 &)>> workloads = {
+            { "lab1_1", benchmark_lab1_1 },
+            { "lab1_2", benchmark_lab1_2 },
+            { "lab2_1", benchmark_lab2_1 },
+            { "lab2_2", benchmark_lab2_2 },
+            { "lab3", benchmark_lab3 }
+    };
+    for (size_t i = 0; i < workloads.size(); i++) {
+        mt19937 random(benchmark_seed + (unsigned)i);
+        workloads[i].second(random);
+    }
+
+    if (as_json) {
+        print_results_as_json();
+    } else {
+        print_results_as_text();
+    }
+
+    for (const BenchmarkResult &result : results) {
+        if (!result.consistent) {
+            return 2;
+        }
+    }
+    return 0;
+}
+
+
+void benchmark_lab1_1(mt19937 &random) {
+    if (!is_selected("lab1_1.simulate_automaton")) {
+        return;
+    }
+
+    // every state has about one edge per symbol, otherwise the number of paths the
+    // simulation follows grows exponentially with the length of the string
+    const int state_count = 16 * benchmark_scale;
+    const string alphabet = "abcd";
+    vector<vector<char>> adjacency(state_count, vector<char>(state_count, 0));
+    for (int from = 0; from < state_count; from++) {
+        for (size_t edge = 0; edge < alphabet.size(); edge++) {
+            adjacency[from][random() % state_count] = alphabet[random() % alphabet.size()];
+        }
+    }
+    const int final_state = state_count - 1;
+
+    // half of the strings are walks through the automaton, so some of them are accepted
+    vector<string> strings(1000);
+    double work = 0;
+    for (size_t i = 0; i < strings.size(); i++) {
+        int length = 1 + (int)(random() % 24);
+        int state = 0;
+        for (int k = 0; k < length; k++) {
+            vector<int> next;
+            for (int to = 0; to < state_count; to++) {
+                if (adjacency[state][to] != 0) {
+                    next.emplace_back(to);
+                }
+            }
+            if (i % 2 == 0 && !next.empty()) {
+                int to = next[random() % next.size()];
+                strings[i] += adjacency[state][to];
+                state = to;
+            } else {
+                strings[i] += alphabet[random() % alphabet.size()];
+            }
+        }
+        work += length;
+    }
+
+    measure("lab1_1.simulate_automaton", "symbols", [&] {
+        for (const string &s : strings) {
+            lab1_1::simulate_automaton(adjacency, 0, final_state, s);
+        }
+        return work;
+    });
+}
+
+void benchmark_lab1_2(mt19937 &random) {
+    // programs in the language of Lab1.2sample-program.txt
+    string source;
+    const int function_count = 2000 * benchmark_scale;
+    for (int f = 0; f < function_count; f++) {
+        source += "def function_" + to_string(f) + "()\n";
+        int statements = 1 + (int)(random() % 6);
+        for (int s = 0; s < statements; s++) {
+            source += "    value_" + to_string(random() % 100) + " = ";
+            int operands = 1 + (int)(random() % 4);
+            for (int o = 0; o < operands; o++) {
+                if (o > 0) {
+                    source += string(" ") + "+-*/"[random() % 4] + " ";
+                }
+                if (random() % 2) {
+                    source += to_string(random() % 1000);
+                    if (random() % 4 == 0) {
+                        source += "." + to_string(random() % 100);
+                    }
+                } else {
+                    source += "function_" + to_string(random() % function_count) + "(value)";
+                }
+            }
+            source += "\n";
+        }
+        source += "end\n\n";
+    }
+
+    // the lexers read from a FILE, which fmemopen makes out of the generated text
+    size_t token_counts[2] = { 0, 0 };
+    for (int tables = 0; tables < 2; tables++) {
+        string name = tables ? "lab1_2.get_token_with_tables" : "lab1_2.get_token";
+        if (!is_selected(name)) {
+            continue;
+        }
+        measure(name, "bytes", [&] {
+            FILE *file = fmemopen(&source[0], source.size(), "r");
+            lab1_2::reset_lexer(file);
+            size_t tokens = 0;
+            while ((tables ? lab1_2::get_token_with_tables() : lab1_2::get_token()) != lab1_2::Token::END_OF_FILE) {
+                tokens++;
+            }
+            fclose(file);
+            lab1_2::reset_lexer(stdin);
+            token_counts[tables] = tokens;
+            return (double)source.size();
+        });
+    }
+    if (token_counts[0] != 0 && token_counts[1] != 0 && token_counts[0] != token_counts[1]) {
+        results.back().consistent = false;
+    }
+}
+
+void benchmark_lab2_1(mt19937 &random) {
+    if (!is_selected("lab2_1.build_subset_automaton")) {
+        return;
+    }
+
+    // sparse automata with a few epsilon transitions, denser ones make the construction exponential
+    vector<lab2_1::FiniteAutomaton> automata(20);
+    const vector<int> alphabet = { 'a', 'b', 'c', 'd' };
+    for (lab2_1::FiniteAutomaton &nfa : automata) {
+        nfa.state_count = 24 * benchmark_scale;
+        for (int from = 0; from < nfa.state_count; from++) {
+            int edges = 1 + (int)(random() % 3);
+            for (int e = 0; e < edges; e++) {
+                int symbol = random() % 8 == 0 ? lab2_1::EPSILON : alphabet[random() % alphabet.size()];
+                nfa.transitions.push_back({ from, { symbol, (int)(random() % nfa.state_count) } });
+            }
+        }
+    }
+
+    measure("lab2_1.build_subset_automaton", "states", [&] {
+        size_t states = 0;
+        for (const lab2_1::FiniteAutomaton &nfa : automata) {
+            states += lab2_1::build_subset_automaton(nfa, alphabet, 0).subsets.size();
+        }
+        return (double)states;
+    });
+}
+
+void benchmark_lab2_2(mt19937 &random) {
+    string source = lab2_2::generate_benchmark_source(5000 * benchmark_scale, random());
+    vector<lab2_2::LexedToken> scanned[2];
+    for (int tables = 0; tables < 2; tables++) {
+        string name = tables ? "lab2_2.lex_source.tables" : "lab2_2.lex_source";
+        if (!is_selected(name)) {
+            continue;
+        }
+        lab2_2::table_lexer_enabled = tables == 1;
+        measure(name, "bytes", [&] {
+            scanned[tables] = lab2_2::lex_source(source);
+            return (double)source.size();
+        });
+        lab2_2::table_lexer_enabled = false;
+    }
+    if (!scanned[0].empty() && !scanned[1].empty() && scanned[0].size() != scanned[1].size()) {
+        results.back().consistent = false;
+    }
+
+    // the parallel parser and evaluator run with as many threads as there are cores
+    const int jobs = max(2, (int)thread::hardware_concurrency());
+    benchmark_lab2_2_evaluation(random, jobs);
+
+    if (!is_selected("lab2_2.parse")) {
+        return;
+    }
+    vector<lab2_2::LexedToken> tokens = lab2_2::lex_source(source);
+    vector<lab2_2::TopLevelItem> reference = lab2_2::parse_top_level_items(source, tokens);
+
+    const vector<pair<string, pair<bool, int>>> parsers = {
+            { "lab2_2.parse.recursive_descent", { false, 1 } },
+            { "lab2_2.parse.tables", { true, 1 } },
+            { "lab2_2.parse.parallel", { false, jobs } }
+    };
+    for (auto &parser : parsers) {
+        if (!is_selected(parser.first)) {
+            continue;
+        }
+        lab2_2::table_parser_enabled = parser.second.first;
+        bool same = true;
+        BenchmarkResult &result = measure(parser.first, "tokens", [&] {
+            vector<lab2_2::TopLevelItem> items = parser.second.second > 1
+                    ? lab2_2::parse_top_level_items_parallel(source, tokens, parser.second.second)
+                    : lab2_2::parse_top_level_items(source, tokens);
+            same = same && items.size() == reference.size();
+            for (size_t i = 0; same && i < items.size(); i++) {
+                same = lab2_2::same_top_level_item(items[i], reference[i]);
+            }
+            for (lab2_2::TopLevelItem &item : items) {
+                lab2_2::delete_top_level_item(item);
+            }
+            return (double)tokens.size();
+        });
+        result.consistent = same;
+        lab2_2::table_parser_enabled = false;
+    }
+
+    for (lab2_2::TopLevelItem &item : reference) {
+        lab2_2::delete_top_level_item(item);
+    }
+}
+
+void benchmark_lab2_2_evaluation(mt19937 &random, int jobs) {
+    if (!is_selected("lab2_2.evaluate")) {
+        return;
+    }
+
+    // recursive calls on both sides of the operators, so that the parallel evaluator has work to fork
+    string source = "import func if_func(condition, true_branch, false_branch)\n"
+                    "func fib(n) if_func(n < 2, n, fib(n-1) + fib(n-2))\n";
+    for (int i = 0; i < 8; i++) {
+        int n = 12 + (int)(random() % 4) + 2 * benchmark_scale;
+        source += "fib(" + to_string(n) + ") * 2 + fib(" + to_string(n - 1) + ")\n";
+    }
+    vector<lab2_2::LexedToken> tokens = lab2_2::lex_source(source);
+    vector<lab2_2::TopLevelItem> items = lab2_2::parse_top_level_items(source, tokens);
+
+    string outputs[2];
+    const vector<pair<string, int>> evaluators = {
+            { "lab2_2.evaluate.sequential", 1 },
+            { "lab2_2.evaluate.parallel", jobs }
+    };
+    for (size_t e = 0; e < evaluators.size(); e++) {
+        if (!is_selected(evaluators[e].first)) {
+            continue;
+        }
+        measure(evaluators[e].first, "items", [&] {
+            lab2_2::Evaluator evaluator(evaluators[e].second);
+            outputs[e].clear();
+            for (const lab2_2::TopLevelItem &item : items) {
+                evaluator.evaluate_item(item, outputs[e]);
+            }
+            return (double)items.size();
+        });
+    }
+    if (!outputs[0].empty() && !outputs[1].empty() && outputs[0] != outputs[1]) {
+        results.back().consistent = false;
+    }
+
+    for (lab2_2::TopLevelItem &item : items) {
+        lab2_2::delete_top_level_item(item);
+    }
+}
+
+void benchmark_lab3(mt19937 &random) {
+    if (!is_selected("lab3")) {
+        return;
+    }
+
+    // every nonterminal gets a rule of terminals first, so all of them are productive and
+    // derivations can be finished by always choosing that rule
+    const int nonterminal_count = 24 * benchmark_scale;
+    const string terminals = "abcde";
+    auto nonterminal_name = [](int n) { return n == 0 ? string("S") : "<N" + to_string(n) + ">"; };
+
+    // rules as lists of symbols, nonterminals are numbered from 0 and terminals are
+    // stored as -1-index into terminals
+    vector<vector<vector<int>>> rules(nonterminal_count);
+    for (int n = 0; n < nonterminal_count; n++) {
+        vector<int> finishing;
+        int length = 1 + (int)(random() % 2);
+        for (int k = 0; k < length; k++) {
+            finishing.emplace_back(-1 - (int)(random() % terminals.size()));
+        }
+        rules[n].emplace_back(finishing);
+
+        int rule_count = 1 + (int)(random() % 4);
+        for (int r = 0; r < rule_count; r++) {
+            vector<int> rhs;
+            // null and unit productions are rare, but make every conversion stage do some work
+            int kind = (int)(random() % 10);
+            int length = kind == 0 ? 0 : kind == 1 ? 1 : 2 + (int)(random() % 3);
+            for (int k = 0; k < length; k++) {
+                bool terminal = kind != 1 && random() % 3 == 0;
+                rhs.emplace_back(terminal ? -1 - (int)(random() % terminals.size()) : (int)(random() % nonterminal_count));
+            }
+            rules[n].emplace_back(rhs);
+        }
+    }
+
+    string text;
+    for (int n = 0; n < nonterminal_count; n++) {
+        text += nonterminal_name(n) + " ->";
+        for (size_t r = 0; r < rules[n].size(); r++) {
+            text += r == 0 ? " " : " | ";
+            if (rules[n][r].empty()) {
+                text += lab3::NULL_CHARACTER;
+            }
+            for (int symbol : rules[n][r]) {
+                text += symbol < 0 ? string(1, terminals[-1 - symbol]) : nonterminal_name(symbol);
+            }
+        }
+        text += "\n";
+    }
+    text += "\n";
+
+    // words derived from the start symbol, random rules are chosen until the word is long enough
+    const int target_length = 24 * benchmark_scale;
+    vector<string> words;
+    while (words.size() < 20) {
+        string word;
+        vector<int> pending = { 0 };
+        while (!pending.empty()) {
+            int symbol = pending.back();
+            pending.pop_back();
+            if (symbol < 0) {
+                word += terminals[-1 - symbol];
+                continue;
+            }
+            bool finish = (int)(word.size() + pending.size()) >= target_length;
+            const vector<int> &rhs = rules[symbol][finish ? 0 : random() % rules[symbol].size()];
+            pending.insert(pending.end(), rhs.rbegin(), rhs.rend());
+        }
+        if (!word.empty()) {
+            words.emplace_back(word);
+        }
+    }
+    double word_symbols = 0;
+    for (const string &word : words) {
+        word_symbols += (double)word.size();
+    }
+
+    // the conversion runs as a whole in every iteration, each stage is reported separately
+    const vector<pair<string, void (*)(lab3::Grammar &)>> stages = {
+            { "lab3.eliminate_null_productions", lab3::eliminate_null_productions },
+            { "lab3.eliminate_unit_productions", lab3::eliminate_unit_productions },
+            { "lab3.eliminate_useless_symbols", lab3::eliminate_useless_symbols },
+            { "lab3.transform_into_cnf", lab3::transform_into_cnf }
+    };
+    lab3::Grammar original, converted;
+    if (is_selected("lab3.read_grammar")) {
+        measure("lab3.read_grammar", "rules", [&] {
+            istringstream input(text);
+            original = lab3::read_grammar(input);
+            return (double)original.rule_count();
+        });
+    } else {
+        istringstream input(text);
+        original = lab3::read_grammar(input);
+    }
+
+    vector<BenchmarkResult> stage_results(stages.size());
+    lab3::reset_peak_memory();
+    for (int i = 0; i < benchmark_iterations; i++) {
+        converted = original;
+        for (size_t s = 0; s < stages.size(); s++) {
+            stage_results[s].work = (double)converted.rule_count();
+            auto started = chrono::steady_clock::now();
+            stages[s].second(converted);
+            stage_results[s].latencies.emplace_back(elapsed_since(started));
+        }
+    }
+    for (size_t s = 0; s < stages.size(); s++) {
+        if (is_selected(stages[s].first)) {
+            stage_results[s].name = stages[s].first;
+            stage_results[s].unit = "rules";
+            stage_results[s].peak_rss_kb = lab3::peak_memory_kb();
+            results.emplace_back(stage_results[s]);
+        }
+    }
+
+    auto encode = [](const lab3::Grammar &g, const string &word) {
+        vector<lab3::Symbol> encoded;
+        for (char c : word) {
+            encoded.emplace_back(g.symbols.find(string(1, c)));
+        }
+        return encoded;
+    };
+
+    // every word is derivable, so both parsers have to accept all of them
+    bool all_accepted = true;
+    if (is_selected("lab3.cyk")) {
+        lab3::CykParser parser(converted);
+        BenchmarkResult &result = measure("lab3.cyk", "symbols", [&] {
+            for (const string &word : words) {
+                all_accepted = parser.recognize(encode(converted, word), 1) && all_accepted;
+            }
+            return word_symbols;
+        });
+        result.consistent = all_accepted;
+    }
+    if (is_selected("lab3.earley")) {
+        lab3::EarleyParser parser(original);
+        all_accepted = true;
+        BenchmarkResult &result = measure("lab3.earley", "symbols", [&] {
+            for (const string &word : words) {
+                all_accepted = parser.recognize(encode(original, word), false) && all_accepted;
+            }
+            return word_symbols;
+        });
+        result.consistent = all_accepted;
+    }
+}
+
+
+bool is_selected(const string &name) {
+    if (only_prefixes.empty()) {
+        return true;
+    }
+    for (const string &prefix : only_prefixes) {
+        // either the name starts with the prefix, or the prefix starts with the name
+        // so that a group of workloads is prepared when one of its members is selected
+        size_t common = min(prefix.size(), name.size());
+        if (prefix.compare(0, common, name, 0, common) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+double elapsed_since(chrono::steady_clock::time_point started) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+}
+
+BenchmarkResult& measure(const string &name, const string &unit, const function<double()> &iteration) {
+    BenchmarkResult result;
+    result.name = name;
+    result.unit = unit;
+
+    // one untimed run warms up caches and allocator
+    iteration();
+    lab3::reset_peak_memory();
+    for (int i = 0; i < benchmark_iterations; i++) {
+        auto started = chrono::steady_clock::now();
+        result.work = iteration();
+        result.latencies.emplace_back(elapsed_since(started));
+    }
+    result.peak_rss_kb = lab3::peak_memory_kb();
+
+    results.emplace_back(result);
+    return results.back();
+}
+
+double percentile(vector<double> sorted, double fraction) {
+    // nearest rank
+    sort(sorted.begin(), sorted.end());
+    size_t rank = (size_t)ceil(fraction * sorted.size());
+    return sorted[min(max(rank, (size_t)1), sorted.size()) - 1];
+}
+
+void print_results_as_text() {
+    for (const BenchmarkResult &result : results) {
+        double total = 0;
+        for (double latency : result.latencies) {
+            total += latency;
+        }
+        double throughput = result.work * result.latencies.size() / max(total, 1e-9) * 1000.0;
+        printf("%s: %.4g %s/s, latency p50 %.3f p90 %.3f p99 %.3f max %.3f ms, peak %ld KB%s\n",
+               result.name.c_str(), throughput, result.unit.c_str(),
+               percentile(result.latencies, 0.5), percentile(result.latencies, 0.9),
+               percentile(result.latencies, 0.99), percentile(result.latencies, 1.0),
+               result.peak_rss_kb, result.consistent ? "" : ", INCONSISTENT");
+    }
+}
+
+void print_results_as_json() {
+    printf("{\n  \"seed\": %u,\n  \"iterations\": %d,\n  \"scale\": %d,\n  \"results\": [",
+           benchmark_seed, benchmark_iterations, benchmark_scale);
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchmarkResult &result = results[i];
+        double total = 0;
+        for (double latency : result.latencies) {
+            total += latency;
+        }
+        printf("%s\n    {\"name\": \"%s\", \"unit\": \"%s\", \"work\": %.17g, \"throughput\": %.17g, "
+               "\"latency_ms\": {\"p50\": %.6f, \"p90\": %.6f, \"p99\": %.6f, \"max\": %.6f, \"mean\": %.6f}, "
+               "\"peak_rss_kb\": %ld, \"consistent\": %s}",
+               i > 0 ? "," : "", result.name.c_str(), result.unit.c_str(), result.work,
+               result.work * result.latencies.size() / max(total, 1e-9) * 1000.0,
+               percentile(result.latencies, 0.5), percentile(result.latencies, 0.9),
+               percentile(result.latencies, 0.99), percentile(result.latencies, 1.0),
+               total / result.latencies.size(), result.peak_rss_kb, result.consistent ? "true" : "false");
+    }
+    printf("\n  ]\n}\n");
+}
@@ -0,0 +1,301 @@
+// counters and timers for the hot paths of the labs, compiled in only when FLPC_INSTRUMENT
+// is defined (g++ -DFLPC_INSTRUMENT ...), otherwise every macro expands to nothing
+//
+//   INSTRUMENT_COUNT(name, amount)   adds amount to a counter
+//   INSTRUMENT_MAX(name, value)      keeps the highest value seen, e.g. a queue high-water mark
+//   INSTRUMENT_SCOPE(name)           times the rest of the enclosing block
+//   INSTRUMENT_RATIO(name, numerator, denominator, scale)
+//                                    reported as numerator / denominator * scale, used at file scope;
+//                                    timers count nanoseconds, so a scale of 1e9 gives a rate per second
+//
+// every thread updates its own copy of the counters without locking, they are merged when the
+// thread exits; at the exit of the program a summary is printed to stderr, or, when the FLPC_TRACE
+// environment variable names a file, timed scopes and final counter values are written there in
+// chrome trace format, to be opened with chrome://tracing or ui.perfetto.dev
+#ifndef FLPC_INSTRUMENTATION_H
+#define FLPC_INSTRUMENTATION_H
+
+#ifdef FLPC_INSTRUMENT
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace flpc {
+
+enum CounterKind {
+    counter_sum,
+    counter_maximum,
+    counter_timer
+};
+
+struct CounterValue {
+    // sum of the amounts, nanoseconds for timers
+    int64_t total = 0;
+    int64_t maximum = 0;
+    int64_t updates = 0;
+};
+
+// a single run of a timed scope, times are nanoseconds since the start of the program
+struct TraceEvent {
+    int counter, thread;
+    int64_t start, duration;
+};
+
+struct Ratio {
+    std::string name;
+    int numerator, denominator;
+    double scale;
+};
+
+// events kept per thread, later ones are only counted, so that tracing needs bounded memory
+const size_t TRACE_EVENT_LIMIT = 1 << 20;
+
+struct ThreadCounters;
+
+class Registry {
+    std::mutex lock;
+    std::vector<std::string> names;
+    std::vector<CounterKind> kinds;
+    std::vector<Ratio> ratios;
+    // counters and events of the threads which have already exited
+    std::vector<CounterValue> totals;
+    std::vector<TraceEvent> events;
+    size_t dropped_events = 0;
+    int thread_count = 0;
+
+    static void merge_value(CounterValue &into, const CounterValue &value) {
+        into.total += value.total;
+        into.maximum = std::max(into.maximum, value.maximum);
+        into.updates += value.updates;
+    }
+
+    double ratio_value(const Ratio &ratio) const {
+        double denominator = (double)totals[ratio.denominator].total;
+        return denominator == 0 ? 0 : totals[ratio.numerator].total / denominator * ratio.scale;
+    }
+
+    void print_summary() const;
+    void write_trace(const char *path) const;
+
+public:
+    const std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    const char *trace_path = getenv("FLPC_TRACE");
+
+    ~Registry() {
+        if (trace_path != nullptr && *trace_path != '\0') {
+            write_trace(trace_path);
+        } else {
+            print_summary();
+        }
+    }
+
+    // counters are identified by their name, a repeated name refers to the same counter;
+    // ratios register the counters they refer to as sums until they are used
+    int add(const char *name, CounterKind kind) {
+        std::lock_guard<std::mutex> guard(lock);
+        for (size_t i = 0; i < names.size(); i++) {
+            if (names[i] == name) {
+                if (kind != counter_sum) {
+                    kinds[i] = kind;
+                }
+                return (int)i;
+            }
+        }
+        names.emplace_back(name);
+        kinds.emplace_back(kind);
+        totals.emplace_back();
+        return (int)names.size() - 1;
+    }
+
+    bool add_ratio(const char *name, const char *numerator, const char *denominator, double scale) {
+        int n = add(numerator, counter_sum), d = add(denominator, counter_sum);
+        std::lock_guard<std::mutex> guard(lock);
+        ratios.push_back({ name, n, d, scale });
+        return true;
+    }
+
+    int add_thread() {
+        std::lock_guard<std::mutex> guard(lock);
+        return thread_count++;
+    }
+
+    void merge(const ThreadCounters &thread);
+
+    int64_t now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count();
+    }
+};
+
+inline Registry& registry() {
+    static Registry instance;
+    return instance;
+}
+
+struct ThreadCounters {
+    const int thread = registry().add_thread();
+    const bool tracing = registry().trace_path != nullptr && *registry().trace_path != '\0';
+    std::vector<CounterValue> values;
+    std::vector<TraceEvent> events;
+    size_t dropped_events = 0;
+
+    ~ThreadCounters() {
+        registry().merge(*this);
+    }
+
+    CounterValue& at(int counter) {
+        if ((size_t)counter >= values.size()) {
+            values.resize(counter + 1);
+        }
+        return values[counter];
+    }
+};
+
+inline ThreadCounters& thread_counters() {
+    thread_local ThreadCounters instance;
+    return instance;
+}
+
+class ScopedTimer {
+    int counter;
+    int64_t start;
+
+public:
+    explicit ScopedTimer(int _counter) : counter(_counter), start(registry().now()) {}
+    ScopedTimer(const ScopedTimer &) = delete;
+    ScopedTimer& operator=(const ScopedTimer &) = delete;
+
+    ~ScopedTimer() {
+        int64_t duration = registry().now() - start;
+        ThreadCounters &thread = thread_counters();
+        CounterValue &value = thread.at(counter);
+        value.total += duration;
+        value.maximum = std::max(value.maximum, duration);
+        value.updates++;
+        if (thread.tracing) {
+            if (thread.events.size() < TRACE_EVENT_LIMIT) {
+                thread.events.push_back({ counter, thread.thread, start, duration });
+            } else {
+                thread.dropped_events++;
+            }
+        }
+    }
+};
+
+inline void Registry::merge(const ThreadCounters &thread) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (size_t i = 0; i < thread.values.size(); i++) {
+        merge_value(totals[i], thread.values[i]);
+    }
+    events.insert(events.end(), thread.events.begin(), thread.events.end());
+    dropped_events += thread.dropped_events;
+}
+
+inline void Registry::print_summary() const {
+    if (names.empty()) {
+        return;
+    }
+    fprintf(stderr, "instrumentation summary, %d threads:\n", thread_count);
+    for (size_t i = 0; i < names.size(); i++) {
+        const CounterValue &value = totals[i];
+        if (value.updates == 0) {
+            continue;
+        }
+        if (kinds[i] == counter_timer) {
+            fprintf(stderr, "  %s: %lld calls, %.3f ms total, %.3f ms max\n", names[i].c_str(),
+                    (long long)value.updates, value.total / 1e6, value.maximum / 1e6);
+        } else if (kinds[i] == counter_maximum) {
+            fprintf(stderr, "  %s: max %lld\n", names[i].c_str(), (long long)value.maximum);
+        } else {
+            fprintf(stderr, "  %s: %lld\n", names[i].c_str(), (long long)value.total);
+        }
+    }
+    for (const Ratio &ratio : ratios) {
+        if (totals[ratio.denominator].total != 0) {
+            fprintf(stderr, "  %s: %.6g\n", ratio.name.c_str(), ratio_value(ratio));
+        }
+    }
+}
+
+inline void Registry::write_trace(const char *path) const {
+    FILE *file = fopen(path, "w");
+    if (file == nullptr) {
+        fprintf(stderr, "instrumentation: can't write trace to %s\n", path);
+        print_summary();
+        return;
+    }
+
+    // complete events for timed scopes, followed by counter events holding the final values
+    fprintf(file, "{\"traceEvents\": [");
+    const char *separator = "\n";
+    for (const TraceEvent &event : events) {
+        fprintf(file, "%s{\"name\": \"%s\", \"cat\": \"flpc\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                      "\"ts\": %.3f, \"dur\": %.3f}",
+                separator, names[event.counter].c_str(), event.thread, event.start / 1e3, event.duration / 1e3);
+        separator = ",\n";
+    }
+    double end = now() / 1e3;
+    for (size_t i = 0; i < names.size(); i++) {
+        const CounterValue &value = totals[i];
+        if (value.updates == 0 || kinds[i] == counter_timer) {
+            continue;
+        }
+        fprintf(file, "%s{\"name\": \"%s\", \"cat\": \"flpc\", \"ph\": \"C\", \"pid\": 1, \"ts\": %.3f, "
+                      "\"args\": {\"value\": %lld}}",
+                separator, names[i].c_str(), end,
+                (long long)(kinds[i] == counter_maximum ? value.maximum : value.total));
+        separator = ",\n";
+    }
+    for (const Ratio &ratio : ratios) {
+        fprintf(file, "%s{\"name\": \"%s\", \"cat\": \"flpc\", \"ph\": \"C\", \"pid\": 1, \"ts\": %.3f, "
+                      "\"args\": {\"value\": %.17g}}",
+                separator, ratio.name.c_str(), end, ratio_value(ratio));
+        separator = ",\n";
+    }
+    fprintf(file, "\n], \"otherData\": {\"dropped_events\": %zu}}\n", dropped_events);
+    fclose(file);
+}
+
+}
+
+#define FLPC_CONCATENATE_(a, b) a##b
+#define FLPC_CONCATENATE(a, b) FLPC_CONCATENATE_(a, b)
+
+#define INSTRUMENT_COUNT(name, amount) do { \
+        static const int flpc_counter = ::flpc::registry().add(name, ::flpc::counter_sum); \
+        ::flpc::CounterValue &flpc_value = ::flpc::thread_counters().at(flpc_counter); \
+        flpc_value.total += (int64_t)(amount); \
+        flpc_value.updates++; \
+    } while (0)
+
+#define INSTRUMENT_MAX(name, value) do { \
+        static const int flpc_counter = ::flpc::registry().add(name, ::flpc::counter_maximum); \
+        ::flpc::CounterValue &flpc_value = ::flpc::thread_counters().at(flpc_counter); \
+        flpc_value.maximum = std::max(flpc_value.maximum, (int64_t)(value)); \
+        flpc_value.updates++; \
+    } while (0)
+
+#define INSTRUMENT_SCOPE(name) \
+    static const int FLPC_CONCATENATE(flpc_timer_, __LINE__) = ::flpc::registry().add(name, ::flpc::counter_timer); \
+    ::flpc::ScopedTimer FLPC_CONCATENATE(flpc_scope_, __LINE__)(FLPC_CONCATENATE(flpc_timer_, __LINE__))
+
+#define INSTRUMENT_RATIO(name, numerator, denominator, scale) \
+    [[maybe_unused]] static const bool FLPC_CONCATENATE(flpc_ratio_, __LINE__) = \
+        ::flpc::registry().add_ratio(name, numerator, denominator, scale)
+
+#else
+
+// the operands are not evaluated, but still count as used
+#define INSTRUMENT_COUNT(name, amount) do { (void)sizeof(amount); } while (0)
+#define INSTRUMENT_MAX(name, value) do { (void)sizeof(value); } while (0)
+#define INSTRUMENT_SCOPE(name) do {} while (0)
+#define INSTRUMENT_RATIO(name, numerator, denominator, scale) static_assert(true, "")
+
+#endif
+
+#endif
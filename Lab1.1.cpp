@@ -3,6 +3,7 @@
 #include <queue>
 #include <utility>
 #include <tuple>
+#include "Instrumentation.h"
 using namespace std;
 
 
@@ -18,38 +19,56 @@ const vector<vector<char>> ADJ_MATRIX = {
 const int START_STATE = 0; /* A */
 const int FINAL_STATE = 4; /* F */
 
+// checks whether the automaton given by its adjacency matrix accepts the string
+bool simulate_automaton(const vector<vector<char>> &adjacency, int start_state, int final_state,
+                        const string &input_string);
 
+
+// other programs include this file to call simulate_automaton, defining FLPC_NO_MAIN
+#ifndef FLPC_NO_MAIN
 int main() {
     string input_string;
     getline(cin, input_string);
 
+    bool is_valid = simulate_automaton(ADJ_MATRIX, START_STATE, FINAL_STATE, input_string);
+
+    if (is_valid) cout << "is valid" << endl;
+    else cout << "is not valid" << endl;
+
+
+    return 0;
+}
+#endif
+
+
+bool simulate_automaton(const vector<vector<char>> &adjacency, int start_state, int final_state,
+                        const string &input_string) {
+    INSTRUMENT_SCOPE("simulate_automaton");
     // pairs of (state, index)
     queue<pair<int, int>> next_states;
-    next_states.push(make_pair(START_STATE, 0));
-    bool is_valid = false;
+    next_states.push(make_pair(start_state, 0));
 
     while (!next_states.empty()) {
         int state, index;
         tie(state, index) = next_states.front(); // takes the next element from the queue
         next_states.pop();
-
+
         //in case it reaches the final state
-        if (state == FINAL_STATE && index == (int)input_string.length()) {
-            is_valid = true;
-            break;
+        if (state == final_state && index == (int)input_string.length()) {
+            return true;
+        }
+        // the whole string is consumed, empty cells of the matrix would match its terminating '\0'
+        if (index == (int)input_string.length()) {
+            continue;
         }
         //checks each character
         char current_character = input_string[index];
-        for (int i = 0; i < (int)ADJ_MATRIX[state].size(); i++) {
-            if (ADJ_MATRIX[state][i] == current_character) {
+        for (int i = 0; i < (int)adjacency[state].size(); i++) {
+            if (adjacency[state][i] == current_character) {
                 next_states.push(make_pair(i, index + 1));
             }
         }
+        INSTRUMENT_MAX("simulate_automaton.queue", next_states.size());
     }
-
-    if (is_valid) cout << "is valid" << endl;
-    else cout << "is not valid" << endl;
-
-
-    return 0;
+    return false;
 }
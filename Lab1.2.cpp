@@ -1,5 +1,8 @@
 #include <iostream>
 #include <cstdio>
+#include <cstring>
+#include <string>
+#include "Instrumentation.h"
 using namespace std;
 
 enum class Token {  //Types of tokens
@@ -20,15 +23,50 @@ string identifier_value;  //ex. some_function
 char operation_value;
 char character_value;
 
+// scanner tables generated by Lab2.1LexerGenerator
+#include "Lab1.2LexerTables.inc"
+
+// set by the command line, scans with the generated DFA instead of get_token
+bool table_lexer_enabled = false;
+
+// state of the scanners, reset_lexer makes them read another file from its start
+FILE *input_file = stdin;
+char last_char = ' ';
+string table_input;
+size_t table_position = 0;
+bool table_input_loaded = false;
+
+void reset_lexer(FILE *file) {
+    input_file = file;
+    last_char = ' ';
+    table_input.clear();
+    table_position = 0;
+    table_input_loaded = false;
+}
+
+// rates reported by instrumented builds
+INSTRUMENT_RATIO("get_token.bytes_per_token", "get_token.bytes", "get_token.tokens", 1);
+INSTRUMENT_RATIO("get_token.tokens_per_second", "get_token.tokens", "get_token", 1e9);
+INSTRUMENT_RATIO("get_token_with_tables.bytes_per_token", "get_token_with_tables.bytes",
+                 "get_token_with_tables.tokens", 1);
+INSTRUMENT_RATIO("get_token_with_tables.tokens_per_second", "get_token_with_tables.tokens",
+                 "get_token_with_tables", 1e9);
+
+static int read_char() {
+    INSTRUMENT_COUNT("get_token.bytes", 1);
+    return getc(input_file);
+}
+
 Token get_token() {     //identifies the type of the next token
-    static char last_char = ' ';
+    INSTRUMENT_SCOPE("get_token");
+    INSTRUMENT_COUNT("get_token.tokens", 1);
 
     while (isspace(last_char))
-        last_char = getchar();
+        last_char = read_char();
 
     if (isalpha(last_char) || last_char == '_') {
         identifier_value = last_char;
-        while ((last_char = getchar()) && (isalnum(last_char) || last_char == '_')) {
+        while ((last_char = read_char()) && (isalnum(last_char) || last_char == '_')) {
             identifier_value += last_char; // concatenation
         }
 
@@ -43,7 +81,7 @@ Token get_token() {     //identifies the type of the next token
         string number;
         while (isdigit(last_char) || last_char == '.') {
             number += last_char;
-            last_char = getchar();
+            last_char = read_char();
         }
 
         number_value = strtod(number.c_str(), 0);
@@ -51,7 +89,7 @@ Token get_token() {     //identifies the type of the next token
     }
 
     character_value = last_char;
-    last_char = getchar();
+    last_char = read_char();
 
     if (character_value == EOF)
         return Token::END_OF_FILE;
@@ -65,13 +103,88 @@ Token get_token() {     //identifies the type of the next token
     return Token::CHARACTER;
 }
 
+Token get_token_with_tables() {     //same tokens as get_token, recognized by the generated DFA
+    INSTRUMENT_SCOPE("get_token_with_tables");
+    INSTRUMENT_COUNT("get_token_with_tables.tokens", 1);
+    // the whole input is read at once, so the scanner can look past the end of a token
+    string &input = table_input;
+    size_t &position = table_position;
+    if (!table_input_loaded) {
+        char buffer[1 << 16];
+        size_t count;
+        while ((count = fread(buffer, 1, sizeof(buffer), input_file)) > 0) {
+            input.append(buffer, count);
+        }
+        table_input_loaded = true;
+    }
 
-int main() {
-    // temporary bind stdin to local file
-    freopen(".\\Lab1.2sample-program.txt", "r", stdin);
+    while (true) {
+        if (position >= input.size()) {
+            character_value = EOF;
+            return Token::END_OF_FILE;
+        }
+
+        // maximal munch: the token ends where a state accepted last
+        int state = LEX_INITIAL_STATE, accepted = lex_character;
+        size_t start = position, end = position + 1;
+        for (size_t i = position; i < input.size(); i++) {
+            state = LEX_TRANSITIONS[state * LEX_CLASS_COUNT + LEX_BYTE_CLASS[(unsigned char)input[i]]];
+            if (state == 0)
+                break;
+            if (LEX_ACCEPTED[state] >= 0) {
+                accepted = LEX_ACCEPTED[state];
+                end = i + 1;
+            }
+        }
+        position = end;
+        INSTRUMENT_COUNT("get_token_with_tables.bytes", end - start);
+
+        switch (accepted) {
+            case lex_whitespace:
+                continue;
+            case lex_definition:
+            case lex_definition_end:
+            case lex_identifier:
+                identifier_value = input.substr(start, end - start);
+                if (accepted == lex_definition)
+                    return Token::DEFINITION;
+                if (accepted == lex_definition_end)
+                    return Token::DEFINITION_END;
+                return Token::IDENTIFIER;
+            case lex_number:
+                number_value = strtod(input.substr(start, end - start).c_str(), 0);
+                return Token::NUMBER;
+        }
+
+        character_value = input[start];
+        if (accepted == lex_open_bracket)
+            return Token::OPEN_BRACKET;
+        if (accepted == lex_close_bracket)
+            return Token::CLOSE_BRACKET;
+        if (accepted == lex_operation)
+            return Token::OPERATION;
+        return Token::CHARACTER;
+    }
+}
+
+
+// other programs include this file to call the scanners, defining FLPC_NO_MAIN
+#ifndef FLPC_NO_MAIN
+int main(int argc, char **argv) {
+    const char *input_path = "Lab1.2sample-program.txt";
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-L") == 0 || strcmp(argv[i], "--table-lexer") == 0) {
+            table_lexer_enabled = true;
+        } else {
+            input_path = argv[i];
+        }
+    }
+
+    // bind stdin to the input file
+    freopen(input_path, "r", stdin);
 
     Token token;
-    while ((token = get_token()) != Token::END_OF_FILE) {
+    while ((token = table_lexer_enabled ? get_token_with_tables() : get_token()) != Token::END_OF_FILE) {
         switch (token) {
             case Token::DEFINITION:
                 cout << "definition " << identifier_value << endl;
@@ -98,4 +211,5 @@ int main() {
     }
 
     return 0;
-}
+}
+#endif
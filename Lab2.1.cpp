@@ -3,8 +3,37 @@
 #include <set>
 #include <map>
 #include <queue>
+#include <algorithm>
+#include "Instrumentation.h"
 using namespace std;
 
+// symbol of transitions which don't consume input
+const int EPSILON = -1;
+
+// non-deterministic finite automata, states are numbered from 0 to state_count-1
+struct FiniteAutomaton {
+    int state_count = 0;
+    // list of elements of form (from, (symbol, next_state))
+    vector<pair<int, pair<int, int>>> transitions;
+};
+
+// deterministic finite automata built by subset construction
+struct SubsetAutomaton {
+    // every new state is a sorted set of NDFA states, state 0 is the initial one
+    vector<vector<int>> subsets;
+    // list of elements of form (from, (symbol, next_state)), only non-empty next states are kept
+    vector<pair<int, pair<int, int>>> transitions;
+};
+
+// outgoing edges of every state as (symbol, next_state)
+vector<vector<pair<int, int>>> group_transitions(const FiniteAutomaton &nfa);
+// adds all states reachable through epsilon transitions
+vector<int> epsilon_closure(const vector<vector<pair<int, int>>> &edges, vector<int> states);
+SubsetAutomaton build_subset_automaton(const FiniteAutomaton &nfa, const vector<int> &alphabet, int initial_state);
+
+
+// other programs include this file to reuse the construction, defining FLPC_NO_MAIN
+#ifndef FLPC_NO_MAIN
 int main() {
     // describe initial non-deterministic finite automata
     const vector<int> states = { 0, 1, 2, 3 };
@@ -21,55 +50,28 @@ int main() {
     };
 
     // generate new deterministic finite automata
+    FiniteAutomaton nfa;
+    nfa.state_count = (int)states.size();
+    for (auto &row : transition_table) {
+        nfa.transitions.push_back({ row.first, { row.second.first, row.second.second } });
+    }
+    SubsetAutomaton dfa = build_subset_automaton(nfa, vector<int>(alphabet.begin(), alphabet.end()), 0);
 
     // new state could be composed of several NDFA states
     // we would store it as a bitmask, where position of turned on bit indicates presence of according NDFA state
-    set<int> new_states;
-    set<pair<int, pair<char, int>>> new_transition_table;
-
-    queue<int> need_review;
-
-    // inserting first state
-    // (1 << index) to mark state at index
-    need_review.push(1 << 0); //need to be reviewed, state0
-    new_states.insert(1 << 0); //already reviewed, state0
-
-    while (!need_review.empty()) {
-        int states_mask = need_review.front(); //we take the first state and work with it
-        need_review.pop();                     //we remove the first state from the queue
-
-        for (char symbol : alphabet) {
-            int reachable_states_mask = 0;
-
-            // deconstructing mask into a simple list
-            // 32 because using 32-bit integers
-            vector<int> states_indexes;      //states to be reviewed
-            for (int i = 0; i < 32; i++) {
-                if ((states_mask & (1 << i)) != 0) {
-                    states_indexes.push_back(i);
-                }
-            }
-
-            for (int state : states_indexes) {
-                // find outgoing edges from this state labeled with symbol
-                for (auto &row : transition_table) {
-                    if (row.first != state || row.second.first != symbol)
-                        continue;
-
-                    reachable_states_mask |= 1 << (row.second.second);  //creating reachable states
-                }
-            }
-
-            // if newly created  reachable state is not yet visited
-            if (reachable_states_mask != 0) {
-                if (new_states.find(reachable_states_mask) == new_states.end()) {
-                    new_states.insert(reachable_states_mask);
-                    need_review.push(reachable_states_mask);
-                }
-
-                new_transition_table.insert({ states_mask, { symbol, reachable_states_mask }});
-            }
+    vector<int> masks;
+    for (auto &subset : dfa.subsets) {
+        int mask = 0;
+        for (int state : subset) {
+            mask |= 1 << state;
         }
+        masks.push_back(mask);
+    }
+
+    set<int> new_states(masks.begin(), masks.end());
+    set<pair<int, pair<char, int>>> new_transition_table;
+    for (auto &row : dfa.transitions) {
+        new_transition_table.insert({ masks[row.first], { (char)row.second.first, masks[row.second.second] }});
     }
 
     // creating optional state mapping
@@ -87,3 +89,82 @@ int main() {
     }
     return 0;
 }
+#endif
+
+
+vector<vector<pair<int, int>>> group_transitions(const FiniteAutomaton &nfa) {
+    vector<vector<pair<int, int>>> edges(nfa.state_count);
+    for (auto &row : nfa.transitions) {
+        edges[row.first].push_back(row.second);
+    }
+    return edges;
+}
+
+vector<int> epsilon_closure(const vector<vector<pair<int, int>>> &edges, vector<int> states) {
+    vector<bool> reached(edges.size(), false);
+    for (int state : states) {
+        reached[state] = true;
+    }
+
+    for (size_t i = 0; i < states.size(); i++) {
+        for (auto &edge : edges[states[i]]) {
+            if (edge.first == EPSILON && !reached[edge.second]) {
+                reached[edge.second] = true;
+                states.push_back(edge.second);
+            }
+        }
+    }
+    sort(states.begin(), states.end());
+    return states;
+}
+
+SubsetAutomaton build_subset_automaton(const FiniteAutomaton &nfa, const vector<int> &alphabet, int initial_state) {
+    INSTRUMENT_SCOPE("build_subset_automaton");
+    vector<vector<pair<int, int>>> edges = group_transitions(nfa);
+    SubsetAutomaton dfa;
+    map<vector<int>, int> state_ids;
+
+    queue<int> need_review;
+
+    // inserting first state
+    dfa.subsets.push_back(epsilon_closure(edges, { initial_state }));
+    state_ids.insert({ dfa.subsets[0], 0 });
+    need_review.push(0);
+
+    while (!need_review.empty()) {
+        int state = need_review.front(); //we take the first state and work with it
+        need_review.pop();               //we remove the first state from the queue
+
+        // targets of all outgoing edges, grouped by symbol
+        map<int, vector<int>> reachable;
+        for (int nfa_state : dfa.subsets[state]) {
+            for (auto &edge : edges[nfa_state]) {
+                if (edge.first != EPSILON) {
+                    reachable[edge.first].push_back(edge.second);
+                }
+            }
+        }
+
+        for (int symbol : alphabet) {
+            auto it = reachable.find(symbol);
+            if (it == reachable.end()) {
+                continue;
+            }
+
+            sort(it->second.begin(), it->second.end());
+            it->second.erase(unique(it->second.begin(), it->second.end()), it->second.end());
+            vector<int> subset = epsilon_closure(edges, it->second);
+
+            // if newly created reachable state is not yet visited
+            auto found = state_ids.find(subset);
+            if (found == state_ids.end()) {
+                found = state_ids.insert({ subset, (int)dfa.subsets.size() }).first;
+                dfa.subsets.push_back(subset);
+                need_review.push(found->second);
+                INSTRUMENT_MAX("build_subset_automaton.queue", need_review.size());
+            }
+            dfa.transitions.push_back({ state, { symbol, found->second } });
+        }
+    }
+    return dfa;
+}
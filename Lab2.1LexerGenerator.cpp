@@ -0,0 +1,388 @@
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <bitset>
+
+// reuses the subset construction of Lab2.1 without its demonstration program
+#define FLPC_NO_MAIN
+#include "Lab2.1.cpp"
+
+
+// builds table-driven scanners for Lab1.2 and Lab2.2 from token patterns: every pattern
+// becomes a Thompson NFA, their union is determinized by subset construction, minimized,
+// and written as a dense transition table over byte classes
+
+// describes a token, earlier definitions win between matches of the same length
+struct TokenDefinition {
+    const char *name;
+    const char *pattern;
+};
+
+const vector<TokenDefinition> LAB1_2_TOKENS = {
+    { "whitespace", "[ \t\n\v\f\r]+" },
+    { "definition", "def" },
+    { "definition_end", "end" },
+    { "identifier", "[a-zA-Z_][a-zA-Z0-9_]*" },
+    { "number", "[0-9.]+" },
+    { "open_bracket", "\\(" },
+    { "close_bracket", "\\)" },
+    { "operation", "[-+*/=]" },
+    { "character", "." },
+};
+
+const vector<TokenDefinition> LAB2_2_TOKENS = {
+    { "whitespace", "[ \t\n\v\f\r]+" },
+    { "comment", "#[^\n\r]*" },
+    { "func", "func" },
+    { "import", "import" },
+    { "identifier", "[a-zA-Z_][a-zA-Z0-9_]*" },
+    { "number", "[0-9.]+" },
+    { "character", "." },
+};
+
+using ByteSet = bitset<256>;
+
+// NFA whose edges are labeled with sets of bytes, before bytes are replaced by classes
+struct PatternAutomaton {
+    int state_count = 0;
+    // (from, (byte set index or EPSILON, next_state))
+    vector<pair<int, pair<int, int>>> edges;
+    vector<ByteSet> byte_sets;
+    // index of the token accepted in every state, or -1
+    vector<int> accepted;
+
+    int add_state() {
+        accepted.push_back(-1);
+        return state_count++;
+    }
+};
+
+// minimized DFA: state 0 rejects everything, state 1 is the initial one
+struct ScannerTables {
+    vector<int> byte_class;
+    int class_count = 0;
+    vector<int> transitions;
+    vector<int> accepted;
+    int nfa_states = 0, dfa_states = 0;
+};
+
+// pattern routines
+static bool parse_pattern(PatternAutomaton &nfa, const char *&pattern, int &start, int &end);
+static bool compile_tokens(const vector<TokenDefinition> &tokens, PatternAutomaton &nfa);
+
+// automaton routines
+static vector<int> find_byte_classes(const PatternAutomaton &nfa, int &class_count);
+static ScannerTables build_scanner(const PatternAutomaton &nfa);
+static void minimize_scanner(ScannerTables &tables);
+static bool write_scanner(const char *path, const vector<TokenDefinition> &tokens, const ScannerTables &tables);
+
+
+int main() {
+    const struct {
+        const char *path;
+        const vector<TokenDefinition> &tokens;
+    } scanners[] = {
+        { "Lab1.2LexerTables.inc", LAB1_2_TOKENS },
+        { "Lab2.2LexerTables.inc", LAB2_2_TOKENS },
+    };
+
+    for (auto &scanner : scanners) {
+        PatternAutomaton nfa;
+        if (!compile_tokens(scanner.tokens, nfa)) {
+            return 1;
+        }
+        ScannerTables tables = build_scanner(nfa);
+        minimize_scanner(tables);
+
+        printf("info: %s: %d NFA states, %d DFA states, %d after minimization, %d byte classes\n", scanner.path,
+               tables.nfa_states, tables.dfa_states, (int)tables.accepted.size(), tables.class_count);
+        if (!write_scanner(scanner.path, scanner.tokens, tables)) {
+            printf("error: can't write %s\n", scanner.path);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// reads a single byte of a pattern, resolving escapes
+static int pattern_byte(const char *&pattern) {
+    if (*pattern != '\\') {
+        return (unsigned char)*pattern++;
+    }
+    pattern++;
+    switch (char c = *pattern++) {
+        case 'n': return '\n';
+        case 't': return '\t';
+        case 'r': return '\r';
+        case 'v': return '\v';
+        case 'f': return '\f';
+        default: return (unsigned char)c;
+    }
+}
+
+// parses an operand: a byte, an escaped byte, a class, any byte or a group
+static bool parse_atom(PatternAutomaton &nfa, const char *&pattern, int &start, int &end) {
+    ByteSet bytes;
+    if (*pattern == '(') {
+        pattern++;
+        if (!parse_pattern(nfa, pattern, start, end) || *pattern != ')') {
+            return false;
+        }
+        pattern++;
+        return true;
+    } else if (*pattern == '.') {
+        pattern++;
+        bytes.set();
+    } else if (*pattern == '[') {
+        pattern++;
+        bool negated = *pattern == '^';
+        if (negated) {
+            pattern++;
+        }
+        // a '-' at the start or the end of the class is an ordinary byte
+        do {
+            if (*pattern == 0) {
+                return false;
+            }
+            int first = pattern_byte(pattern), last = first;
+            if (*pattern == '-' && pattern[1] != ']' && pattern[1] != 0) {
+                pattern++;
+                last = pattern_byte(pattern);
+            }
+            for (int c = first; c <= last; c++) {
+                bytes.set(c);
+            }
+        } while (*pattern != ']');
+        pattern++;
+        if (negated) {
+            bytes.flip();
+        }
+    } else if (*pattern == 0 || strchr("|)*+?", *pattern)) {
+        return false;
+    } else {
+        bytes.set(pattern_byte(pattern));
+    }
+
+    start = nfa.add_state();
+    end = nfa.add_state();
+    nfa.byte_sets.push_back(bytes);
+    nfa.edges.push_back({ start, { (int)nfa.byte_sets.size() - 1, end } });
+    return true;
+}
+
+bool parse_pattern(PatternAutomaton &nfa, const char *&pattern, int &start, int &end) {
+    // Thompson construction: every sub-pattern is a fragment with one entry and one exit
+    start = nfa.add_state();
+    end = nfa.add_state();
+    while (true) {
+        // a sequence of atoms with repetition operators
+        int sequence_start = nfa.add_state(), sequence_end = sequence_start;
+        while (*pattern != 0 && *pattern != '|' && *pattern != ')') {
+            int atom_start, atom_end;
+            if (!parse_atom(nfa, pattern, atom_start, atom_end)) {
+                return false;
+            }
+            while (*pattern == '*' || *pattern == '+' || *pattern == '?') {
+                int loop_start = nfa.add_state(), loop_end = nfa.add_state();
+                nfa.edges.push_back({ loop_start, { EPSILON, atom_start } });
+                nfa.edges.push_back({ atom_end, { EPSILON, loop_end } });
+                if (*pattern != '+') {
+                    nfa.edges.push_back({ loop_start, { EPSILON, loop_end } });
+                }
+                if (*pattern != '?') {
+                    nfa.edges.push_back({ atom_end, { EPSILON, atom_start } });
+                }
+                atom_start = loop_start;
+                atom_end = loop_end;
+                pattern++;
+            }
+            nfa.edges.push_back({ sequence_end, { EPSILON, atom_start } });
+            sequence_end = atom_end;
+        }
+
+        nfa.edges.push_back({ start, { EPSILON, sequence_start } });
+        nfa.edges.push_back({ sequence_end, { EPSILON, end } });
+        if (*pattern != '|') {
+            return true;
+        }
+        pattern++;
+    }
+}
+
+bool compile_tokens(const vector<TokenDefinition> &tokens, PatternAutomaton &nfa) {
+    int initial = nfa.add_state();
+    for (int token = 0; token < (int)tokens.size(); token++) {
+        const char *pattern = tokens[token].pattern;
+        int start, end;
+        if (!parse_pattern(nfa, pattern, start, end) || *pattern != 0) {
+            printf("error: malformed pattern of %s at '%s'\n", tokens[token].name, pattern);
+            return false;
+        }
+        nfa.edges.push_back({ initial, { EPSILON, start } });
+        nfa.accepted[end] = token;
+    }
+    return true;
+}
+
+vector<int> find_byte_classes(const PatternAutomaton &nfa, int &class_count) {
+    // bytes which belong to exactly the same byte sets are never told apart by the automaton
+    map<vector<bool>, int> classes;
+    vector<int> byte_class(256);
+    for (int c = 0; c < 256; c++) {
+        vector<bool> membership(nfa.byte_sets.size());
+        for (size_t i = 0; i < nfa.byte_sets.size(); i++) {
+            membership[i] = nfa.byte_sets[i][c];
+        }
+        byte_class[c] = classes.insert({ membership, (int)classes.size() }).first->second;
+    }
+    class_count = (int)classes.size();
+    return byte_class;
+}
+
+ScannerTables build_scanner(const PatternAutomaton &patterns) {
+    ScannerTables tables;
+    tables.byte_class = find_byte_classes(patterns, tables.class_count);
+
+    // edges labeled with byte sets become one edge per byte class contained in the set
+    vector<int> representative(tables.class_count);
+    for (int c = 255; c >= 0; c--) {
+        representative[tables.byte_class[c]] = c;
+    }
+    FiniteAutomaton nfa;
+    nfa.state_count = patterns.state_count;
+    for (auto &edge : patterns.edges) {
+        if (edge.second.first == EPSILON) {
+            nfa.transitions.push_back(edge);
+            continue;
+        }
+        for (int byte_class = 0; byte_class < tables.class_count; byte_class++) {
+            if (patterns.byte_sets[edge.second.first][representative[byte_class]]) {
+                nfa.transitions.push_back({ edge.first, { byte_class, edge.second.second } });
+            }
+        }
+    }
+
+    vector<int> alphabet(tables.class_count);
+    for (int byte_class = 0; byte_class < tables.class_count; byte_class++) {
+        alphabet[byte_class] = byte_class;
+    }
+    SubsetAutomaton dfa = build_subset_automaton(nfa, alphabet, 0);
+    tables.nfa_states = nfa.state_count;
+    tables.dfa_states = (int)dfa.subsets.size();
+
+    // subset i becomes state i+1, the rejecting state 0 loops to itself
+    int state_count = (int)dfa.subsets.size() + 1;
+    tables.transitions.assign((size_t)state_count * tables.class_count, 0);
+    tables.accepted.assign(state_count, -1);
+    for (auto &row : dfa.transitions) {
+        tables.transitions[(size_t)(row.first + 1) * tables.class_count + row.second.first] = row.second.second + 1;
+    }
+    for (int state = 0; state < (int)dfa.subsets.size(); state++) {
+        for (int nfa_state : dfa.subsets[state]) {
+            int token = patterns.accepted[nfa_state];
+            int &accepted = tables.accepted[state + 1];
+            if (token != -1 && (accepted == -1 || token < accepted)) {
+                accepted = token;
+            }
+        }
+    }
+    return tables;
+}
+
+void minimize_scanner(ScannerTables &tables) {
+    // Moore's partition refinement: states start grouped by the token they accept and are
+    // split by the groups of their successors until the partition is stable; the rejecting
+    // and initial states are kept apart so that they remain states 0 and 1
+    int state_count = (int)tables.accepted.size(), class_count = tables.class_count;
+    vector<int> group(state_count);
+    for (int state = 0; state < state_count; state++) {
+        group[state] = state < 2 ? state : tables.accepted[state] + 3;
+    }
+
+    int group_count = 0;
+    while (true) {
+        map<vector<int>, int> signatures;
+        vector<int> refined(state_count);
+        for (int state = 0; state < state_count; state++) {
+            vector<int> signature = { group[state] };
+            for (int c = 0; c < class_count; c++) {
+                signature.push_back(group[tables.transitions[(size_t)state * class_count + c]]);
+            }
+            refined[state] = signatures.insert({ signature, (int)signatures.size() }).first->second;
+        }
+        group.swap(refined);
+        if ((int)signatures.size() == group_count) {
+            break;
+        }
+        group_count = (int)signatures.size();
+    }
+
+    // groups are numbered in order of their first state, which keeps states 0 and 1 in place
+    vector<int> transitions((size_t)group_count * class_count), accepted(group_count);
+    for (int state = 0; state < state_count; state++) {
+        for (int c = 0; c < class_count; c++) {
+            transitions[(size_t)group[state] * class_count + c] = group[tables.transitions[(size_t)state * class_count + c]];
+        }
+        accepted[group[state]] = tables.accepted[state];
+    }
+    tables.transitions.swap(transitions);
+    tables.accepted.swap(accepted);
+}
+
+static void write_array(FILE *file, const char *type, const char *name, const vector<int> &values, int per_line) {
+    fprintf(file, "static const %s %s[%d] = {", type, name, (int)values.size());
+    for (size_t i = 0; i < values.size(); i++) {
+        fprintf(file, "%s%d,", i % per_line == 0 ? "\n    " : " ", values[i]);
+    }
+    fprintf(file, "\n};\n\n");
+}
+
+bool write_scanner(const char *path, const vector<TokenDefinition> &tokens, const ScannerTables &tables) {
+    FILE *file = fopen(path, "w");
+    if (file == nullptr) {
+        return false;
+    }
+
+    int state_count = (int)tables.accepted.size();
+    fprintf(file, "// generated by Lab2.1LexerGenerator, do not edit\n");
+    fprintf(file, "// maximal munch scanner: %d states over %d byte classes, state 0 rejects, state 1 is initial\n",
+            state_count, tables.class_count);
+    for (const TokenDefinition &token : tokens) {
+        // control characters are written back as escapes
+        string pattern;
+        for (const char *c = token.pattern; *c; c++) {
+            switch (*c) {
+                case '\n': pattern += "\\n"; break;
+                case '\t': pattern += "\\t"; break;
+                case '\r': pattern += "\\r"; break;
+                case '\v': pattern += "\\v"; break;
+                case '\f': pattern += "\\f"; break;
+                default: pattern += *c; break;
+            }
+        }
+        fprintf(file, "//   %-16s %s\n", token.name, pattern.c_str());
+    }
+    fprintf(file, "\n");
+
+    fprintf(file, "const int LEX_STATE_COUNT = %d;\n", state_count);
+    fprintf(file, "const int LEX_CLASS_COUNT = %d;\n", tables.class_count);
+    fprintf(file, "const int LEX_INITIAL_STATE = 1;\n\n");
+
+    fprintf(file, "// tokens in order of priority\n");
+    fprintf(file, "enum LexToken {\n");
+    for (size_t token = 0; token < tokens.size(); token++) {
+        fprintf(file, "    lex_%s%s\n", tokens[token].name, token + 1 < tokens.size() ? "," : "");
+    }
+    fprintf(file, "};\n\n");
+
+    fprintf(file, "// byte class of every byte\n");
+    write_array(file, "unsigned char", "LEX_BYTE_CLASS", tables.byte_class, 16);
+    fprintf(file, "// next state for state * LEX_CLASS_COUNT + byte class\n");
+    write_array(file, state_count <= 256 ? "unsigned char" : "unsigned short", "LEX_TRANSITIONS",
+                tables.transitions, tables.class_count);
+    fprintf(file, "// token accepted in every state, or -1\n");
+    write_array(file, "signed char", "LEX_ACCEPTED", tables.accepted, 16);
+
+    return fclose(file) == 0;
+}
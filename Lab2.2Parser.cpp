@@ -1,8 +1,27 @@
 #include <string>
 #include <cstdio>
 #include <vector>
-#include <map>
+#include <map>
+#include <array>
+#include <algorithm>
+#include <unordered_map>
 #include <cctype>
+#include <cstring>
+#include <cstdint>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <random>
+#include <functional>
+#include "Instrumentation.h"
 using namespace std;
 
 
@@ -16,19 +35,71 @@ enum Token {
     tok_number
 };
 
-// used for tree printing
+// used for tree printing, writes the indentation of a level at once from a block of
+// spaces which is only extended when a deeper level is reached
 static void pad_output(int level) {
-    while (level--) {
-        printf("  ");
+    static string spaces;
+    size_t width = 2 * (size_t)level;
+    if (spaces.size() < width) {
+        spaces.resize(max(width, 2 * spaces.size()), ' ');
     }
+    fwrite(spaces.data(), 1, width, stdout);
 }
 
 
+// defines all possible expression node types
+enum ExpressionKind {
+    expr_number,
+    expr_variable,
+    expr_binary,
+    expr_call
+};
+
+
 // describes a node of abstract syntax tree
 class ExpressionNode {
 public:
+    ExpressionNode() { INSTRUMENT_COUNT("ast.nodes_allocated", 1); }
     virtual ~ExpressionNode() = default;
-    virtual void print_description(int tab=0) = 0;
+    virtual ExpressionKind kind() const = 0;
+    // prints the node itself, the operands are printed by print_description
+    virtual void print_node(int tab) const = 0;
+    // forgets about child nodes without deleting them, used when nodes are shared
+    virtual void release_operands() {}
+    virtual void collect_operands(vector<ExpressionNode *> &) const {}
+
+    // prints the subtree without recursion, so that deep trees can't overflow the stack
+    void print_description(int tab=0) const {
+        vector<pair<const ExpressionNode *, int>> pending = { { this, tab } };
+        vector<ExpressionNode *> operands;
+        while (!pending.empty()) {
+            auto [node, level] = pending.back();
+            pending.pop_back();
+            node->print_node(level);
+
+            // operands are pushed in reverse, so that the first one is printed first
+            operands.clear();
+            node->collect_operands(operands);
+            for (auto it = operands.rbegin(); it != operands.rend(); ++it) {
+                pending.emplace_back(*it, level+1);
+            }
+        }
+    }
+
+protected:
+    // deletes operand subtrees without recursion, so that deep trees can't overflow the stack
+    static void delete_operands(vector<ExpressionNode *> pending) {
+        while (!pending.empty()) {
+            ExpressionNode *node = pending.back();
+            pending.pop_back();
+            if (node == nullptr) {
+                continue;
+            }
+            node->collect_operands(pending);
+            node->release_operands();
+            delete node;
+        }
+    }
 };
 
 class NumberExpressionNode : public ExpressionNode {
@@ -37,7 +108,10 @@ class NumberExpressionNode : public ExpressionNode {
 public:
     NumberExpressionNode(double _value) : value(_value) {}
 
-    void print_description(int tab) {
+    ExpressionKind kind() const { return expr_number; }
+    double get_value() const { return value; }
+
+    void print_node(int tab) const {
         pad_output(tab);
         printf("number: %.4f\n", value);
     }
@@ -47,9 +121,12 @@ class VariableExpressionNode : public ExpressionNode {
     string name;
 
 public:
-    VariableExpressionNode(const string &_name) : name(_name) {}
+    VariableExpressionNode(string _name) : name(move(_name)) {}
 
-    void print_description(int tab) {
+    ExpressionKind kind() const { return expr_variable; }
+    const string& get_name() const { return name; }
+
+    void print_node(int tab) const {
         pad_output(tab);
         printf("variable: %s\n", name.c_str());
     }
@@ -64,15 +141,26 @@ public:
             : operation(_operation), lhs(_lhs), rhs(_rhs) {}
 
     ~BinaryExpressionNode() {
-        delete lhs;
-        delete rhs;
+        delete_operands({ lhs, rhs });
     }
 
-    void print_description(int tab) {
+    ExpressionKind kind() const { return expr_binary; }
+    char get_operation() const { return operation; }
+    ExpressionNode* get_lhs() const { return lhs; }
+    ExpressionNode* get_rhs() const { return rhs; }
+
+    void release_operands() {
+        lhs = rhs = nullptr;
+    }
+
+    void collect_operands(vector<ExpressionNode *> &operands) const {
+        operands.emplace_back(lhs);
+        operands.emplace_back(rhs);
+    }
+
+    void print_node(int tab) const {
         pad_output(tab);
         printf("binary operation: %c\n", operation);
-        lhs->print_description(tab+1);
-        rhs->print_description(tab+1);
     }
 };
 
@@ -81,23 +169,30 @@ class FunctionCallExpressionNode : public ExpressionNode {
     vector<ExpressionNode *> arguments;
 
 public:
-    FunctionCallExpressionNode(const string &_name, const vector<ExpressionNode *> &_args)
-            : function_name(_name), arguments(_args) {}
+    FunctionCallExpressionNode(string _name, vector<ExpressionNode *> _args)
+            : function_name(move(_name)), arguments(move(_args)) {}
 
     ~FunctionCallExpressionNode() {
-        for (ExpressionNode *argument : arguments) {
-            delete argument;
-        }
+        delete_operands(arguments);
     }
 
-    void print_description(int tab) {
+    ExpressionKind kind() const { return expr_call; }
+    const string& get_function_name() const { return function_name; }
+    const vector<ExpressionNode *>& get_arguments() const { return arguments; }
+
+    void release_operands() {
+        arguments.clear();
+    }
+
+    void collect_operands(vector<ExpressionNode *> &operands) const {
+        operands.insert(operands.end(), arguments.begin(), arguments.end());
+    }
+
+    void print_node(int tab) const {
         pad_output(tab);
         printf("function name: %s\n", function_name.c_str());
         pad_output(tab);
         printf("arguments:\n");
-        for (ExpressionNode *node : arguments) {
-            node->print_description(tab+1);
-        }
     }
 };
 
@@ -106,8 +201,11 @@ class FunctionPrototypeNode {
     vector<string> arguments;
 
 public:
-    FunctionPrototypeNode(const string &_name, const vector<string> &_args)
-            : function_name(_name), arguments(_args) {}
+    FunctionPrototypeNode(string _name, vector<string> _args)
+            : function_name(move(_name)), arguments(move(_args)) {}
+
+    const string& get_name() const { return function_name; }
+    const vector<string>& get_arguments() const { return arguments; }
 
     void print_description(int tab) {
         pad_output(tab);
@@ -122,9 +220,33 @@ public:
     }
 };
 
+// owns nodes which may be shared between several parents (hash-consed nodes)
+class ExpressionPool {
+    vector<ExpressionNode *> nodes;
+
+public:
+    ExpressionPool() = default;
+    ExpressionPool(const ExpressionPool &) = delete;
+    ExpressionPool& operator=(const ExpressionPool &) = delete;
+
+    ~ExpressionPool() {
+        for (ExpressionNode *node : nodes) {
+            node->release_operands();
+            delete node;
+        }
+    }
+
+    ExpressionNode* adopt(ExpressionNode *node) {
+        nodes.emplace_back(node);
+        return node;
+    }
+};
+
 class FunctionDefinitionNode {
     FunctionPrototypeNode *prototype;
     ExpressionNode *body;
+    // if set, body nodes belong to the pool instead of forming a tree
+    ExpressionPool *pool = nullptr;
 
 public:
     FunctionDefinitionNode(FunctionPrototypeNode *_proto, ExpressionNode *_body)
@@ -132,7 +254,25 @@ public:
 
     ~FunctionDefinitionNode() {
         delete prototype;
-        delete body;
+        if (pool != nullptr) {
+            delete pool;
+        } else {
+            delete body;
+        }
+    }
+
+    FunctionPrototypeNode* get_prototype() const { return prototype; }
+    ExpressionNode* get_body() const { return body; }
+
+    // replaces the body with a graph whose nodes are owned by _pool
+    void replace_body(ExpressionNode *_body, ExpressionPool *_pool) {
+        if (pool != nullptr) {
+            delete pool;
+        } else {
+            delete body;
+        }
+        body = _body;
+        pool = _pool;
     }
 
     void print_description(int tab) {
@@ -146,25 +286,72 @@ public:
 };
 
 
-// global variables that hold data parsed by the lexer
-double number_value;
-string identifier_value;
-// stores last read token
-int current_token;
-
-// constants used by parser
-const map<int, int> BINARY_OPERATION_PRECEDENCE = {
-        { '<', 10 },
-        { '>', 10 },
-        { '=', 10 },
-        { '+', 20 },
-        { '-', 20 },
-        { '*', 40 },
-        { '/', 40 }
+// describes a token produced by the lexer, identifiers are kept as a range of the source
+struct LexedToken {
+    int kind;
+    size_t offset, length;
+    double number;
 };
 
+// global variables that hold data of the last read token, every parsing thread has its own copy
+thread_local double number_value;
+thread_local string identifier_value;
+// stores last read token
+thread_local int current_token;
+// range of the token buffer which is being parsed
+thread_local const char *token_source;
+thread_local const LexedToken *token_cursor, *token_end;
+
+// constants used by parser, indexed by ascii code, -1 marks non-operators
+const array<int, 128> BINARY_OPERATION_PRECEDENCE = [] {
+    array<int, 128> table;
+    table.fill(-1);
+    table['<'] = 10;
+    table['>'] = 10;
+    table['='] = 10;
+    table['+'] = 20;
+    table['-'] = 20;
+    table['*'] = 40;
+    table['/'] = 40;
+    return table;
+}();
+
+// LALR(1) tables generated by Lab2.2ParserGenerator from Lab2.2ParserGrammar.txt
+#include "Lab2.2ParserTables.inc"
+// scanner tables generated by Lab2.1LexerGenerator
+#include "Lab2.2LexerTables.inc"
+
+// terminal of the parse tables for every token, indexed like BINARY_OPERATION_PRECEDENCE
+const array<int, 128> LR_TERMINAL_OF_TOKEN = [] {
+    array<int, 128> table;
+    table.fill(-1);
+    for (int terminal = 0; terminal < LR_TERMINAL_COUNT; terminal++) {
+        table[LR_TERMINAL_TOKENS[terminal]] = terminal;
+    }
+    return table;
+}();
+
+// set by the command line, enables optimization pass between parser and output
+bool optimization_enabled = false;
+// set by the command line, parses with the generated tables instead of recursive descent
+bool table_parser_enabled = false;
+// set by the command line, scans with the generated DFA instead of the hand-written lexer
+bool table_lexer_enabled = false;
+// set by the command line, number of threads parsing top-level items
+int parser_jobs = 1;
+// set by the command line, evaluates the program instead of printing its syntax tree
+bool evaluation_enabled = false;
+// set by the command line, number of threads evaluating top-level expressions
+int evaluation_jobs = 1;
+
 
 // lexer routines
+static string read_input();
+static int lex_token(const string &source, size_t &position, LexedToken &token);
+static int lex_token_by_hand(const string &source, size_t &position, LexedToken &token);
+static int lex_token_with_tables(const string &source, size_t &position, LexedToken &token);
+static vector<LexedToken> lex_source(const string &source);
+static void bind_token_range(const string &source, const LexedToken *begin, const LexedToken *end);
 static int get_token();
 static int get_next_token();
 static int get_token_precedence();
@@ -173,231 +360,775 @@ static int get_token_precedence();
 static void log_error(const char *message);
 static ExpressionNode* parse_expression();
 static ExpressionNode* parse_number_expression();
-static ExpressionNode* parse_parentheses_expression();
-static ExpressionNode* parse_identifier_expression();
-static ExpressionNode* parse_primary();
-static ExpressionNode* parse_binop_rhs(int min_precedence, ExpressionNode *lhs);
 static FunctionPrototypeNode* parse_function_prototype();
 static FunctionDefinitionNode* parse_function_definition();
 static FunctionDefinitionNode* parse_top_level_expression();
 static FunctionPrototypeNode* parse_function_import();
 
+// optimizer routines
+struct OptimizationStatistics {
+    int nodes_before, nodes_after;
+    int evaluations_before, evaluations_after;
+};
+static bool fold_binary_operation(char operation, double lhs, double rhs, double &result);
+static void count_expression_graph(ExpressionNode *root, int &nodes, int &evaluations);
+static ExpressionNode* optimize_expression(ExpressionNode *root, ExpressionPool *pool);
+static OptimizationStatistics optimize_function_definition(FunctionDefinitionNode *function);
+
 // parser high-level routines
-static void handle_function_definition();
-static void handle_function_import();
-static void handle_top_level_expression();
 
+// result of parsing a single top-level item, kept until it is printed
+struct TopLevelItem {
+    enum Kind { none, definition, import, expression, error } kind = none;
+    FunctionDefinitionNode *function = nullptr;
+    FunctionPrototypeNode *prototype = nullptr;
+    string message;
+    bool optimized = false;
+    OptimizationStatistics stats;
+};
 
-int main() {
-
-    freopen("Lab2.2ParserInput1.txt", "r", stdin);
-    // initialize the current_token variable
-    get_next_token();
+// when set, errors are recorded into it instead of being printed, used by parsing threads
+thread_local vector<TopLevelItem> *error_sink = nullptr;
+
+static TopLevelItem parse_top_level_item();
+static void print_top_level_item(const TopLevelItem &item);
+static void delete_top_level_item(TopLevelItem &item);
+static size_t skip_top_level_item(const vector<LexedToken> &tokens, size_t position);
+static vector<size_t> find_top_level_items(const vector<LexedToken> &tokens);
+static void parse_token_range(const string &source, const LexedToken *begin, const LexedToken *end,
+                              vector<TopLevelItem> &results);
+static void parse_items_with_tables(vector<TopLevelItem> &results);
+static void finish_top_level_item(TopLevelItem &item);
+static vector<TopLevelItem> parse_top_level_items(const string &source, const vector<LexedToken> &tokens);
+static vector<TopLevelItem> parse_top_level_items_parallel(const string &source, const vector<LexedToken> &tokens,
+                                                           int jobs);
+
+// replaces length bytes at offset of the text which was current before the edit
+struct TextEdit {
+    size_t offset, length;
+    string text;
+};
 
-    // start main read loop
-    while (current_token != tok_eof) {
-        switch (current_token) {
-            case tok_func:
-                handle_function_definition();
-                break;
+struct ReparseStatistics {
+    size_t relexed_tokens, reparsed_items, total_items;
+};
 
-            case tok_import:
-                handle_function_import();
-                break;
+// keeps source, tokens and parsed items between edits, so that only the edited
+// region is lexed again and only the top-level items overlapping it are parsed again
+class IncrementalDocument {
+    // every item owns its part of the source, from its first token (from the start of the
+    // source for the first item) up to the first token of the next one, and its tokens
+    // with offsets relative to that part; items form a treap ordered by position, which
+    // keeps sizes of subtrees, so that neither finding nor replacing items visits the others
+    struct DocumentItem {
+        string text;
+        vector<LexedToken> tokens;
+        // the parsed item, or the error reported for a malformed one
+        vector<TopLevelItem> results;
+
+        unsigned priority;
+        DocumentItem *left = nullptr, *right = nullptr;
+        size_t subtree_items = 1, subtree_length = 0;
+    };
+
+    DocumentItem *root = nullptr;
+    mt19937 priorities;
+
+    static void update(DocumentItem *item);
+    static DocumentItem* merge(DocumentItem *a, DocumentItem *b);
+    // moves the first count items into first, the rest into second
+    static void split(DocumentItem *items, size_t count, DocumentItem *&first, DocumentItem *&second);
+    // index of the item holding the byte at offset and offset of its text
+    size_t find_item(size_t offset, size_t &item_offset) const;
+    static void destroy(DocumentItem *items);
+
+    // lexes text and cuts it into parsed items, the first one starting at the start of text
+    DocumentItem* build_items(const string &text, const vector<LexedToken> &tokens, const vector<size_t> &starts,
+                              size_t &item_count);
+    ReparseStatistics apply_edit(const TextEdit &edit);
 
-            default:
-                handle_top_level_expression();
-                break;
-        }
-    }
-    return 0;
-}
+public:
+    IncrementalDocument(const string &_source);
+    IncrementalDocument(const IncrementalDocument &) = delete;
+    IncrementalDocument& operator=(const IncrementalDocument &) = delete;
+    ~IncrementalDocument();
 
+    string get_source() const;
+    vector<const TopLevelItem *> get_items() const;
 
-int get_token() {
-    static char last_char = ' ';
+    ReparseStatistics apply_edits(vector<TextEdit> edits);
+};
 
-    while (isspace(last_char))
-        last_char = getchar();
+// binary AST format, all references are indices or offsets relative to the start of their
+// section, so a file can be mapped at any address and read in place without fix-ups
+const char SERIALIZED_AST_MAGIC[8] = "FLPCAST";
+const uint32_t SERIALIZED_AST_VERSION = 2;
+const uint32_t SERIALIZED_AST_BYTE_ORDER = 0x01020304;
+const uint32_t SERIALIZED_NONE = 0xffffffff;
+
+struct SerializedHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    // hash of the source text and of the options it was parsed with
+    uint64_t source_hash;
+    uint32_t item_count, node_count;
+    uint32_t index_count, string_bytes;
+    // sections start from the beginning of the file and are 8-byte aligned
+    uint64_t items_offset, nodes_offset, indices_offset, strings_offset;
+};
 
-    if (isalpha(last_char) || last_char == '_') {
-        identifier_value = last_char;
-        while ((last_char = getchar()) && (isalnum(last_char) || last_char == '_')) {
-            identifier_value += last_char;
-        }
+struct SerializedItem {
+    // TopLevelItem::Kind
+    uint32_t kind;
+    // string offset of the function name, or of the message for errors
+    uint32_t name;
+    // index section position holding the argument count followed by argument name offsets
+    uint32_t arguments;
+    // root node of the body, or SERIALIZED_NONE for imports and errors
+    uint32_t body;
+    uint32_t optimized;
+    int32_t nodes_before, nodes_after, evaluations_before, evaluations_after;
+};
 
-        if (identifier_value == "func")
-            return tok_func;
-        if (identifier_value == "import")
-            return tok_import;
-        return tok_identifier;
-    }
+struct SerializedNode {
+    // ExpressionKind
+    uint8_t kind;
+    char operation;
+    uint16_t reserved;
+    // number: low and high halves of the value bits; variable: name offset;
+    // binary: lhs and rhs node indices; call: name offset and index section position
+    // holding the argument count followed by argument node indices; operands always
+    // precede the nodes using them
+    uint32_t first, second;
+};
 
-    if (isdigit(last_char) || last_char == '.') {
-        string number;
-        while (isdigit(last_char) || last_char == '.') {
-            number += last_char;
-            last_char = getchar();
-        }
+static_assert(sizeof(SerializedHeader) == 72, "unexpected serialized header layout");
+static_assert(sizeof(SerializedItem) == 36, "unexpected serialized item layout");
+static_assert(sizeof(SerializedNode) == 12, "unexpected serialized node layout");
 
-        number_value = strtod(number.c_str(), 0);
-        return tok_number;
-    }
+// read-only view of a mapped binary AST file
+class SerializedAst {
+    void *data = MAP_FAILED;
+    size_t size = 0;
 
-    // if it's a comment, skip until next line
-    if (last_char == '#') {
-        while (last_char != EOF && last_char != '\n' && last_char != '\r') {
-            last_char = getchar();
-        }
-        if (last_char != EOF) {
-            // using recursion to simplify code flow
-            return get_token();
+public:
+    const SerializedHeader *header = nullptr;
+    const SerializedItem *items = nullptr;
+    const SerializedNode *nodes = nullptr;
+    const uint32_t *indices = nullptr;
+    const char *strings = nullptr;
+
+    SerializedAst() = default;
+    SerializedAst(const SerializedAst &) = delete;
+    SerializedAst& operator=(const SerializedAst &) = delete;
+
+    ~SerializedAst() {
+        if (data != MAP_FAILED) {
+            munmap(data, size);
         }
     }
 
-    if (last_char == EOF)
-        return tok_eof;
+    // maps the file and checks every reference in it, a file failing the checks is not used
+    bool load(const char *path);
 
-    int rc = last_char;
-    last_char = getchar();
-    return rc;
-}
+private:
+    bool validate() const;
+};
 
-int get_next_token() {
-    return (current_token = get_token());
-}
+// fork-join task scheduler: every worker owns a deque of tasks, pushes and pops its own
+// tasks at the back and, when it has nothing to do, steals the oldest task of another
+// worker from the front; the thread creating the scheduler is worker 0
+struct Task {
+    void (*run)(Task *task, int worker) = nullptr;
+    atomic<bool> done{false};
+};
 
-int get_token_precedence() {
-    //if (!isascii(current_token))
-    if (current_token < 0 || current_token > 127){
-        return -1;
+class TaskScheduler {
+    struct Worker {
+        mutex lock;
+        deque<Task *> tasks;
+        atomic<int> size{0};
+    };
+
+    vector<Worker> workers;
+    vector<thread> threads;
+    atomic<bool> stopping{false};
+    // idle workers sleep until a task is forked
+    mutex idle_lock;
+    condition_variable idle;
+    atomic<int> queued{0}, sleeping{0};
+
+    Task* steal(int thief);
+    void run_worker(int worker);
+
+public:
+    TaskScheduler(int jobs);
+    TaskScheduler(const TaskScheduler &) = delete;
+    TaskScheduler& operator=(const TaskScheduler &) = delete;
+    ~TaskScheduler();
+
+    int queued_by(int worker) const { return workers[worker].size.load(memory_order_relaxed); }
+    void fork(int worker, Task *task);
+    // returns once the task is done, running it or other tasks meanwhile
+    void join(int worker, Task *task);
+};
+
+// function body with variables and callees resolved, stored in preorder: operands follow
+// their node, and every node is followed by the size-1 other nodes of its subtree
+struct EvaluationNode {
+    ExpressionKind kind;
+    char operation;
+    // whether evaluation has no side effects, estimated number of evaluated nodes
+    bool pure;
+    double cost;
+    // whether the operands are independent and more than one of them is expensive
+    bool forkable;
+    int size, operand_count;
+    // variable: argument position, or -1 for unknown names; call: slot of the callee
+    int index;
+    double number;
+};
+
+// everything a name may refer to in calls; definitions replace earlier ones
+struct FunctionSlot {
+    string name;
+    enum Kind { undefined, defined, imported, builtin_echo, builtin_if } kind = undefined;
+    int argument_count = 0;
+    vector<EvaluationNode> body;
+    bool pure = false;
+    double cost = 0;
+};
+
+// state of a single thread of evaluation; forked operands get their own context
+struct EvaluationContext {
+    int worker = 0;
+    int depth = 0, fork_depth = 0;
+    // context which forked this one, cancellation is inherited from it
+    const EvaluationContext *parent = nullptr;
+    atomic<bool> cancelled{false};
+    string error;
+    // printed by echo, which only runs in the context evaluating the top-level expression
+    string output;
+};
+
+class Evaluator;
+
+struct EvaluationTask : Task {
+    const Evaluator *evaluator;
+    const EvaluationNode *node;
+    const double *arguments;
+    EvaluationContext context;
+    double result;
+    bool succeeded;
+    // tasks forked for the operands following this one, cancelled when it fails
+    EvaluationTask *later_begin, *later_end;
+};
+
+// evaluates the items of a program in order: imports and definitions are recorded, top-level
+// expressions are evaluated; with more than one job, independent operands which are expensive
+// and have no side effects are evaluated as tasks of a scheduler, other operands and the lazy
+// branches of if_func are evaluated in program order, so results and output don't depend on jobs
+class Evaluator {
+    vector<FunctionSlot> functions;
+    unordered_map<string, int> slot_of;
+    bool analysis_outdated = true;
+    TaskScheduler *scheduler = nullptr;
+
+    int find_slot(const string &name);
+    void compile(ExpressionNode *body, const vector<string> &arguments, vector<EvaluationNode> &nodes);
+    double annotate(vector<EvaluationNode> &nodes) const;
+    void analyze();
+
+    static bool is_cancelled(const EvaluationContext &context);
+    bool fail(EvaluationContext &context, const string &message) const;
+    bool can_fork(const EvaluationNode *node, const EvaluationContext &context) const;
+    bool evaluate_in_parallel(const EvaluationNode *node, const double *arguments, EvaluationContext &context,
+                              double *values) const;
+    bool evaluate_call(const EvaluationNode *node, const double *arguments, EvaluationContext &context,
+                       double &result) const;
+    static void echo(double value, EvaluationContext &context);
+    static void run_task(Task *task, int worker);
+
+public:
+    Evaluator(int jobs);
+    Evaluator(const Evaluator &) = delete;
+    Evaluator& operator=(const Evaluator &) = delete;
+    ~Evaluator();
+
+    bool evaluate(const EvaluationNode *node, const double *arguments, EvaluationContext &context,
+                  double &result) const;
+    // appends what the item prints: output of echo and the value of top-level expressions
+    void evaluate_item(const TopLevelItem &item, string &output);
+};
+
+// evaluation is bounded, so that deep recursion reports an error instead of overflowing the stack
+const int EVALUATION_DEPTH_LIMIT = 20000;
+// operands are forked only if estimated to evaluate at least that many nodes, and only
+// near the root of the evaluation, where tasks are large enough to pay for the scheduling
+const double FORK_COST_THRESHOLD = 1000;
+const double COST_LIMIT = 1e12;
+const int FORK_DEPTH_LIMIT = 16;
+
+// benchmark routines
+static string generate_benchmark_source(size_t item_count, unsigned seed);
+static bool same_expression(ExpressionNode *a, ExpressionNode *b);
+static bool same_top_level_item(const TopLevelItem &a, const TopLevelItem &b);
+static void run_parser_benchmark(size_t item_count);
+static void check_incremental_reparse(const string &source);
+static void check_deep_nesting(int depth);
+
+// caching and serialization routines
+static uint64_t hash_source(const string &source);
+static bool write_serialized_ast(const char *path, const vector<TopLevelItem> &items, uint64_t source_hash);
+static void print_serialized_expression(const SerializedAst &ast, uint32_t index, int tab);
+static void print_serialized_ast(const SerializedAst &ast);
+
+
+// other programs include this file to reuse the lexers and parsers, defining FLPC_NO_MAIN
+#ifndef FLPC_NO_MAIN
+int main(int argc, char **argv) {
+    const char *input_path = "Lab2.2ParserInput1.txt";
+    const char *emit_path = nullptr, *load_path = nullptr, *cache_directory = nullptr;
+    vector<TextEdit> edits;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-O") == 0 || strcmp(argv[i], "--optimize") == 0) {
+            optimization_enabled = true;
+        } else if ((strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0) && i+1 < argc) {
+            parser_jobs = atoi(argv[++i]);
+            if (parser_jobs <= 0) {
+                parser_jobs = max(1, (int)thread::hardware_concurrency());
+            }
+        } else if (strcmp(argv[i], "-T") == 0 || strcmp(argv[i], "--table-parser") == 0) {
+            table_parser_enabled = true;
+        } else if (strcmp(argv[i], "-L") == 0 || strcmp(argv[i], "--table-lexer") == 0) {
+            table_lexer_enabled = true;
+        } else if (strcmp(argv[i], "-E") == 0 || strcmp(argv[i], "--evaluate") == 0) {
+            evaluation_enabled = true;
+        } else if (strcmp(argv[i], "--eval-jobs") == 0 && i+1 < argc) {
+            evaluation_jobs = atoi(argv[++i]);
+            if (evaluation_jobs <= 0) {
+                evaluation_jobs = max(1, (int)thread::hardware_concurrency());
+            }
+        } else if (strcmp(argv[i], "--benchmark") == 0 && i+1 < argc) {
+            run_parser_benchmark(strtoull(argv[++i], nullptr, 10));
+            return 0;
+        } else if (strcmp(argv[i], "--emit-ast") == 0 && i+1 < argc) {
+            emit_path = argv[++i];
+        } else if (strcmp(argv[i], "--load-ast") == 0 && i+1 < argc) {
+            load_path = argv[++i];
+        } else if (strcmp(argv[i], "--cache") == 0 && i+1 < argc) {
+            cache_directory = argv[++i];
+        } else if (strcmp(argv[i], "--edit") == 0 && i+1 < argc) {
+            // OFFSET:LENGTH:TEXT where TEXT may contain \n escapes
+            TextEdit edit;
+            int consumed = 0;
+            if (sscanf(argv[++i], "%zu:%zu:%n", &edit.offset, &edit.length, &consumed) < 2 || consumed == 0) {
+                printf("error: malformed edit %s\n", argv[i]);
+                return 1;
+            }
+            for (const char *c = argv[i] + consumed; *c; c++) {
+                if (c[0] == '\\' && c[1] == 'n') {
+                    edit.text += '\n';
+                    c++;
+                } else {
+                    edit.text += *c;
+                }
+            }
+            edits.emplace_back(edit);
+        } else {
+            input_path = argv[i];
+        }
     }
 
-    if (BINARY_OPERATION_PRECEDENCE.count(current_token) == 0) {
-        return -1;
+    if (load_path != nullptr) {
+        SerializedAst ast;
+        if (!ast.load(load_path)) {
+            printf("error: can't load binary AST from %s\n", load_path);
+            return 1;
+        }
+        print_serialized_ast(ast);
+        return 0;
     }
 
-    return BINARY_OPERATION_PRECEDENCE.at(current_token);
-}
+    freopen(input_path, "r", stdin);
+    string source = read_input();
+
+    // parses the whole input, then applies the edits incrementally
+    if (!edits.empty()) {
+        IncrementalDocument document(source);
+        auto stats = document.apply_edits(edits);
+        printf("info: incremental reparse: relexed %zu tokens, reparsed %zu of %zu items\n\n",
+               stats.relexed_tokens, stats.reparsed_items, stats.total_items);
+        for (const TopLevelItem *item : document.get_items()) {
+            print_top_level_item(*item);
+        }
+        return 0;
+    }
 
-ExpressionNode* parse_expression() {
-    auto lhs = parse_primary();
-    if (lhs == nullptr) {
-        return nullptr;
+    // unchanged sources are printed straight from the cache, skipping lexing and parsing
+    uint64_t source_hash = hash_source(source);
+    string cache_path;
+    if (cache_directory != nullptr && !evaluation_enabled) {
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.flpcast", (unsigned long long)source_hash);
+        cache_path = string(cache_directory) + name;
+
+        SerializedAst ast;
+        if (ast.load(cache_path.c_str()) && ast.header->source_hash == source_hash) {
+            print_serialized_ast(ast);
+            return 0;
+        }
     }
 
-    return parse_binop_rhs(0, lhs);
-}
+    vector<LexedToken> tokens = lex_source(source);
+    vector<TopLevelItem> items = parser_jobs > 1 ? parse_top_level_items_parallel(source, tokens, parser_jobs)
+                                                 : parse_top_level_items(source, tokens);
 
-ExpressionNode* parse_number_expression() {
-    auto node = new NumberExpressionNode(number_value);
+    if (emit_path != nullptr && !write_serialized_ast(emit_path, items, source_hash)) {
+        printf("error: can't write binary AST to %s\n", emit_path);
+    }
+    if (!cache_path.empty()) {
+        mkdir(cache_directory, 0755);
+        write_serialized_ast(cache_path.c_str(), items, source_hash);
+    }
 
-    // consume token from the input
-    get_next_token();
+    if (evaluation_enabled) {
+        Evaluator evaluator(evaluation_jobs);
+        for (TopLevelItem &item : items) {
+            string output;
+            evaluator.evaluate_item(item, output);
+            fputs(output.c_str(), stdout);
+            fflush(stdout);
+            delete_top_level_item(item);
+        }
+        return 0;
+    }
 
-    return node;
+    for (TopLevelItem &item : items) {
+        print_top_level_item(item);
+        delete_top_level_item(item);
+    }
+    return 0;
 }
+#endif
 
-ExpressionNode* parse_parentheses_expression() {
-    // consume open bracket '(' character
-    get_next_token();
 
-    auto expression = parse_expression();
-    if (expression == nullptr) {
-        return nullptr;
+string read_input() {
+    string source;
+    char buffer[1 << 16];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), stdin)) > 0) {
+        source.append(buffer, count);
     }
+    return source;
+}
 
-    if (current_token != ')') {
-        log_error("expected a ')' character");
-        return nullptr;
-    }
+// rates reported by instrumented builds
+INSTRUMENT_RATIO("lex_token.bytes_per_token", "lex_token.bytes", "lex_token.tokens", 1);
+INSTRUMENT_RATIO("lex_source.tokens_per_second", "lex_source.tokens", "lex_source", 1e9);
+
+int lex_token(const string &source, size_t &position, LexedToken &token) {
+    size_t start = position;
+    int kind = table_lexer_enabled ? lex_token_with_tables(source, position, token)
+                                   : lex_token_by_hand(source, position, token);
+    INSTRUMENT_COUNT("lex_token.tokens", 1);
+    INSTRUMENT_COUNT("lex_token.bytes", position - start);
+    return kind;
+}
 
-    // consume close bracket ')' character
-    get_next_token();
+int lex_token_by_hand(const string &source, size_t &position, LexedToken &token) {
+    size_t length = source.size();
+    auto at = [&](size_t i) { return i < length ? (unsigned char)source[i] : EOF; };
 
-    return expression;
-}
+    while (true) {
+        while (isspace(at(position)))
+            position++;
+
+        token.offset = position;
+        int last_char = at(position);
+
+        if (isalpha(last_char) || last_char == '_') {
+            while (isalnum(at(++position)) || at(position) == '_');
+            token.length = position - token.offset;
+
+            token.kind = tok_identifier;
+            if (source.compare(token.offset, token.length, "func") == 0)
+                token.kind = tok_func;
+            if (source.compare(token.offset, token.length, "import") == 0)
+                token.kind = tok_import;
+            return token.kind;
+        }
 
-ExpressionNode* parse_identifier_expression() {
-    string identifer = identifier_value;
+        if (isdigit(last_char) || last_char == '.') {
+            while (isdigit(at(position)) || at(position) == '.')
+                position++;
+            token.length = position - token.offset;
 
-    // skip identifier token
-    get_next_token();
+            token.number = strtod(source.substr(token.offset, token.length).c_str(), 0);
+            return (token.kind = tok_number);
+        }
 
-    // its a simple variable
-    if (current_token != '(') {
-        return new VariableExpressionNode(identifer);
+        // if it's a comment, skip until next line
+        if (last_char == '#') {
+            while (at(position) != EOF && at(position) != '\n' && at(position) != '\r') {
+                position++;
+            }
+            continue;
+        }
+
+        token.length = 0;
+        if (last_char == EOF)
+            return (token.kind = tok_eof);
+
+        token.length = 1;
+        position++;
+        return (token.kind = last_char);
     }
+}
 
-    // skip '(' token
-    get_next_token();
-    vector<ExpressionNode *> arguments;
-    while (current_token != ')') {
-        if (auto argument = parse_expression()) {
-            arguments.emplace_back(argument);
-        } else {
-            return nullptr;
+int lex_token_with_tables(const string &source, size_t &position, LexedToken &token) {
+    // maximal munch: the DFA runs until it rejects, the token ends where a state accepted
+    // last; a single byte is always accepted as a character, so some token always matches
+    const unsigned char *text = (const unsigned char *)source.data();
+    size_t length = source.size();
+
+    while (true) {
+        token.offset = position;
+        if (position >= length) {
+            token.length = 0;
+            return (token.kind = tok_eof);
         }
 
-        if (current_token != ',' && current_token != ')') {
-            log_error("expected a comma or a ')' inside function argument list");
-            return nullptr;
+        int state = LEX_INITIAL_STATE, accepted = lex_character;
+        size_t end = position + 1;
+        for (size_t i = position; i < length; i++) {
+            state = LEX_TRANSITIONS[state * LEX_CLASS_COUNT + LEX_BYTE_CLASS[text[i]]];
+            if (state == 0) {
+                break;
+            }
+            if (LEX_ACCEPTED[state] >= 0) {
+                accepted = LEX_ACCEPTED[state];
+                end = i + 1;
+            }
         }
-        if (current_token == ',') {
-            get_next_token();
+        position = end;
+        token.length = end - token.offset;
+
+        switch (accepted) {
+            case lex_whitespace:
+            case lex_comment:
+                continue;
+            case lex_func:
+                return (token.kind = tok_func);
+            case lex_import:
+                return (token.kind = tok_import);
+            case lex_identifier:
+                return (token.kind = tok_identifier);
+            case lex_number:
+                token.number = strtod(source.substr(token.offset, token.length).c_str(), 0);
+                return (token.kind = tok_number);
+            default:
+                return (token.kind = text[token.offset]);
         }
     }
+}
 
-    // skip ')' token
-    get_next_token();
+vector<LexedToken> lex_source(const string &source) {
+    INSTRUMENT_SCOPE("lex_source");
+    vector<LexedToken> tokens;
+    size_t position = 0;
+    LexedToken token;
+    while (lex_token(source, position, token) != tok_eof) {
+        tokens.emplace_back(token);
+    }
+    INSTRUMENT_COUNT("lex_source.tokens", tokens.size());
+    return tokens;
+}
 
-    return new FunctionCallExpressionNode(identifer, arguments);
+void bind_token_range(const string &source, const LexedToken *begin, const LexedToken *end) {
+    token_source = source.data();
+    token_cursor = begin;
+    token_end = end;
 }
 
-ExpressionNode* parse_primary() {
-    switch (current_token) {
-        default:
-            log_error("unexpected token in place of a primary expression");
-            return nullptr;
+int get_token() {
+    if (token_cursor == token_end)
+        return tok_eof;
 
-        case tok_identifier:
-            return parse_identifier_expression();
+    const LexedToken &token = *token_cursor++;
+    if (token.kind == tok_number) {
+        number_value = token.number;
+    } else if (token.kind == tok_identifier || token.kind == tok_func || token.kind == tok_import) {
+        identifier_value.assign(token_source + token.offset, token.length);
+    }
+    return token.kind;
+}
 
-        case tok_number:
-            return parse_number_expression();
+int get_next_token() {
+    return (current_token = get_token());
+}
 
-        case '(':
-            return parse_parentheses_expression();
+int get_token_precedence() {
+    //if (!isascii(current_token))
+    if (current_token < 0 || current_token > 127){
+        return -1;
     }
+
+    return BINARY_OPERATION_PRECEDENCE[current_token];
 }
 
-ExpressionNode* parse_binop_rhs(int min_precedence, ExpressionNode *lhs) {
+// describes an expression whose parsing is in progress
+struct ExpressionFrame {
+    // what encloses the expression: nothing, parentheses or a function call argument list
+    enum Context { top, parentheses, call_argument } context;
+    // where this expression's part of the operand and operator stacks begins
+    size_t operand_base, operator_base;
+    // used by call_argument frames only
+    string function_name;
+    size_t argument_base;
+};
+
+ExpressionNode* parse_expression() {
+    // shunting-yard parsing with explicit stacks instead of recursion, so deeply
+    // nested and very long expressions use bounded native stack and linear time
+    vector<ExpressionFrame> frames;
+    vector<ExpressionNode *> operands;
+    vector<pair<char, int>> operators;
+    vector<ExpressionNode *> arguments;
+
+    auto fail = [&](const char *message) -> ExpressionNode * {
+        if (message != nullptr) {
+            log_error(message);
+        }
+        for (ExpressionNode *node : operands) {
+            delete node;
+        }
+        for (ExpressionNode *node : arguments) {
+            delete node;
+        }
+        return nullptr;
+    };
+
+    // combines the two topmost operands using the topmost operator
+    auto reduce = [&]() {
+        ExpressionNode *rhs = operands.back();
+        operands.pop_back();
+        ExpressionNode *lhs = operands.back();
+        operands.back() = new BinaryExpressionNode(operators.back().first, lhs, rhs);
+        operators.pop_back();
+    };
+
+    frames.push_back({ ExpressionFrame::top, 0, 0, string(), 0 });
+    bool expect_operand = true;
+
     while (true) {
+        ExpressionFrame &frame = frames.back();
+        INSTRUMENT_MAX("parse_expression.depth", frames.size());
+
+        if (expect_operand) {
+            if (current_token == tok_number) {
+                operands.emplace_back(parse_number_expression());
+                expect_operand = false;
+
+            } else if (current_token == tok_identifier) {
+                string identifier = identifier_value;
+                // skip identifier token
+                get_next_token();
+
+                // its a simple variable
+                if (current_token != '(') {
+                    operands.emplace_back(new VariableExpressionNode(identifier));
+                    expect_operand = false;
+                    continue;
+                }
+
+                // skip '(' token
+                get_next_token();
+                if (current_token == ')') {
+                    get_next_token();
+                    operands.emplace_back(new FunctionCallExpressionNode(identifier, vector<ExpressionNode *>()));
+                    expect_operand = false;
+                    continue;
+                }
+                frames.push_back({ ExpressionFrame::call_argument, operands.size(), operators.size(),
+                                   identifier, arguments.size() });
+
+            } else if (current_token == '(') {
+                // consume open bracket '(' character
+                get_next_token();
+                frames.push_back({ ExpressionFrame::parentheses, operands.size(), operators.size(), string(), 0 });
+
+            } else {
+                return fail("unexpected token in place of a primary expression");
+            }
+            continue;
+        }
+
+        // operators of equal precedence are left associative
         int token_precedence = get_token_precedence();
-        if (token_precedence < min_precedence) {
-            return lhs;
+        if (token_precedence >= 0) {
+            while (operators.size() > frame.operator_base && operators.back().second >= token_precedence) {
+                reduce();
+            }
+            operators.emplace_back((char)current_token, token_precedence);
+            // skip operation token
+            get_next_token();
+            expect_operand = true;
+            continue;
         }
 
-        int binary_operation = current_token;
-        // skip operation token
-        get_next_token();
+        // no more operators, so the expression of the current frame is complete
+        while (operators.size() > frame.operator_base) {
+            reduce();
+        }
 
-        auto rhs = parse_primary();
-        if (rhs == nullptr) {
-            return nullptr;
+        if (frame.context == ExpressionFrame::top) {
+            ExpressionNode *expression = operands.back();
+            operands.pop_back();
+            return expression;
         }
 
-        int next_precedence = get_token_precedence();
-        if (token_precedence < next_precedence) {
-            rhs = parse_binop_rhs(token_precedence+1, rhs);
-            if (rhs == nullptr) {
-                return nullptr;
+        if (frame.context == ExpressionFrame::parentheses) {
+            if (current_token != ')') {
+                return fail("expected a ')' character");
             }
+            // consume close bracket ')' character, the operand stays for the enclosing frame
+            get_next_token();
+            frames.pop_back();
+            continue;
+        }
+
+        arguments.emplace_back(operands.back());
+        operands.pop_back();
+
+        if (current_token != ',' && current_token != ')') {
+            return fail("expected a comma or a ')' inside function argument list");
+        }
+        if (current_token == ',') {
+            get_next_token();
+        }
+        if (current_token != ')') {
+            expect_operand = true;
+            continue;
         }
 
-        lhs = new BinaryExpressionNode(binary_operation, lhs, rhs);
+        // skip ')' token
+        get_next_token();
+        vector<ExpressionNode *> call_arguments(arguments.begin() + frame.argument_base, arguments.end());
+        arguments.resize(frame.argument_base);
+        operands.emplace_back(new FunctionCallExpressionNode(frame.function_name, call_arguments));
+        frames.pop_back();
     }
-    return nullptr;
+}
+
+ExpressionNode* parse_number_expression() {
+    auto node = new NumberExpressionNode(number_value);
+
+    // consume token from the input
+    get_next_token();
+
+    return node;
 }
 
 FunctionPrototypeNode* parse_function_prototype() {
@@ -469,42 +1200,2180 @@ FunctionPrototypeNode* parse_function_import() {
     return parse_function_prototype();
 }
 
-void handle_function_definition() {
-    if (auto function = parse_function_definition()) {
-        printf("info: parsed function definition\n");
-        function->print_description(0);
-        printf("\n");
-        delete function;
-    } else {
+TopLevelItem parse_top_level_item() {
+    TopLevelItem item;
+    switch (current_token) {
+        case tok_func:
+            if ((item.function = parse_function_definition())) {
+                item.kind = TopLevelItem::definition;
+            }
+            break;
+
+        case tok_import:
+            if ((item.prototype = parse_function_import())) {
+                item.kind = TopLevelItem::import;
+            }
+            break;
+
+        default:
+            if ((item.function = parse_top_level_expression())) {
+                item.kind = TopLevelItem::expression;
+            }
+            break;
+    }
+
+    if (item.kind == TopLevelItem::none) {
         // if input contains erroneous token, skip it
         get_next_token();
+    } else {
+        finish_top_level_item(item);
     }
+    return item;
 }
 
-void handle_function_import() {
-    if (auto import = parse_function_import()) {
-        printf("info: parsed function import declaration\n");
-        import->print_description(0);
-        printf("\n");
-        delete import;
-    } else {
-        // if input contains erroneous token, skip it
-        get_next_token();
+void finish_top_level_item(TopLevelItem &item) {
+    if (item.function != nullptr && optimization_enabled) {
+        item.stats = optimize_function_definition(item.function);
+        item.optimized = true;
     }
 }
 
-void handle_top_level_expression() {
-    if (auto expression = parse_top_level_expression()) {
-        printf("info: parsed top level expression\n");
-        expression->print_description(0);
-        printf("\n");
-        delete expression;
-    } else {
-        // if input contains erroneous token, skip it
-        get_next_token();
+void print_top_level_item(const TopLevelItem &item) {
+    switch (item.kind) {
+        case TopLevelItem::none:
+            return;
+
+        case TopLevelItem::error:
+            printf("error: %s\n", item.message.c_str());
+            return;
+
+        case TopLevelItem::import:
+            printf("info: parsed function import declaration\n");
+            item.prototype->print_description(0);
+            printf("\n");
+            return;
+
+        case TopLevelItem::definition:
+        case TopLevelItem::expression:
+            if (item.kind == TopLevelItem::definition) {
+                printf("info: parsed function definition\n");
+            } else {
+                printf("info: parsed top level expression\n");
+            }
+            item.function->print_description(0);
+            if (item.optimized) {
+                printf("info: optimized: nodes %d -> %d, evaluations %d -> %d\n", item.stats.nodes_before,
+                       item.stats.nodes_after, item.stats.evaluations_before, item.stats.evaluations_after);
+            }
+            printf("\n");
+            return;
     }
 }
 
-void log_error(const char *message) {
-    printf("error: %s\n", message);
+void delete_top_level_item(TopLevelItem &item) {
+    delete item.function;
+    delete item.prototype;
+    item.function = nullptr;
+    item.prototype = nullptr;
+}
+
+size_t skip_top_level_item(const vector<LexedToken> &tokens, size_t position) {
+    // mirrors the decisions of the parser without building nodes, returns the index
+    // of the token following the item; a malformed item ends with the token the parser
+    // fails at, since it reports the error there and goes on after skipping that token
+    auto failed = [&](size_t token) { return min(token + 1, tokens.size()); };
+    auto kind = [&](size_t i) { return i < tokens.size() ? tokens[i].kind : (int)tok_eof; };
+    auto is_operation = [](int token) {
+        return token >= 0 && token < 128 && BINARY_OPERATION_PRECEDENCE[token] >= 0;
+    };
+
+    bool has_body = true;
+    if (kind(position) == tok_import) {
+        position++;
+        has_body = false;
+    }
+    if (kind(position) == tok_func || !has_body) {
+        if (kind(position++) != tok_func || kind(position++) != tok_identifier || kind(position++) != '(') {
+            return failed(position - 1);
+        }
+        while (kind(position) != ')') {
+            if (kind(position++) != tok_identifier) {
+                return failed(position - 1);
+            }
+            if (kind(position) != ')' && kind(position) != ',') {
+                return failed(position);
+            }
+            if (kind(position) == ',') {
+                position++;
+            }
+        }
+        position++;
+    }
+    if (!has_body) {
+        return position;
+    }
+
+    // enclosing parentheses and call argument lists of the expression
+    vector<char> enclosing;
+    bool expect_operand = true;
+    while (true) {
+        if (expect_operand) {
+            int token = kind(position++);
+            if (token == tok_identifier && kind(position) == '(') {
+                position++;
+                if (kind(position) == ')') {
+                    position++;
+                    expect_operand = false;
+                } else {
+                    enclosing.emplace_back(',');
+                }
+            } else if (token == '(') {
+                enclosing.emplace_back(')');
+            } else if (token == tok_identifier || token == tok_number) {
+                expect_operand = false;
+            } else {
+                return failed(position - 1);
+            }
+            continue;
+        }
+
+        if (is_operation(kind(position))) {
+            position++;
+            expect_operand = true;
+            continue;
+        }
+        if (enclosing.empty()) {
+            return position;
+        }
+
+        if (enclosing.back() == ')') {
+            if (kind(position++) != ')') {
+                return failed(position - 1);
+            }
+            enclosing.pop_back();
+            continue;
+        }
+
+        if (kind(position) != ',' && kind(position) != ')') {
+            return failed(position);
+        }
+        if (kind(position) == ',') {
+            position++;
+        }
+        if (kind(position) == ')') {
+            position++;
+            enclosing.pop_back();
+        } else {
+            expect_operand = true;
+        }
+    }
+}
+
+vector<size_t> find_top_level_items(const vector<LexedToken> &tokens) {
+    // returns the first token of every item, items after a malformed one start where
+    // the parser resumes after its error
+    vector<size_t> starts;
+    size_t position = 0;
+    while (position < tokens.size()) {
+        starts.emplace_back(position);
+        position = skip_top_level_item(tokens, position);
+    }
+    return starts;
+}
+
+void parse_token_range(const string &source, const LexedToken *begin, const LexedToken *end,
+                       vector<TopLevelItem> &results) {
+    error_sink = &results;
+
+    bind_token_range(source, begin, end);
+    // initialize the current_token variable
+    get_next_token();
+
+    if (table_parser_enabled) {
+        parse_items_with_tables(results);
+        error_sink = nullptr;
+        return;
+    }
+
+    // start main read loop
+    while (current_token != tok_eof) {
+        TopLevelItem item = parse_top_level_item();
+        if (item.kind != TopLevelItem::none) {
+            results.emplace_back(item);
+        }
+    }
+
+    error_sink = nullptr;
+}
+
+// describes a grammar symbol on the stack of the table-driven parser, its semantic
+// value is the part of the node, name and operation stacks starting at the bases
+struct LrFrame {
+    int state;
+    uint32_t node_base, name_base, operation_base;
+};
+
+void parse_items_with_tables(vector<TopLevelItem> &results) {
+    // semantic values are kept on three shared stacks instead of per symbol: reducing
+    // a rule leaves the values of its right-hand side concatenated, and only rules
+    // building nodes replace them with the result
+    vector<LrFrame> frames = { { 0, 0, 0, 0 } };
+    vector<ExpressionNode *> nodes;
+    // identifiers are kept as their tokens, strings are only made for the nodes built from them
+    vector<const LexedToken *> names;
+    vector<char> operations;
+    FunctionPrototypeNode *prototype = nullptr;
+    auto name_of = [](const LexedToken *token) { return string(token_source + token->offset, token->length); };
+
+    // frames between top-level items and the first token of the item being parsed
+    vector<LrFrame> item_frames;
+    const LexedToken *item_start = token_cursor - (current_token == tok_eof ? 0 : 1);
+
+    // reads the next token like get_next_token, but leaves identifier_value alone,
+    // since identifiers are taken from their tokens
+    auto advance = []() {
+        if (token_cursor == token_end) {
+            current_token = tok_eof;
+            return;
+        }
+        const LexedToken &token = *token_cursor++;
+        if (token.kind == tok_number) {
+            number_value = token.number;
+        }
+        current_token = token.kind;
+    };
+
+    auto action_of = [](int state, int terminal) {
+        int i = LR_ACTION_BASE[state] + terminal;
+        return LR_ACTION_CHECK[i] == state ? LR_ACTION_NEXT[i] : LR_DEFAULT_REDUCTION[state];
+    };
+    auto goto_of = [](int state, int nonterminal) {
+        int i = LR_GOTO_BASE[nonterminal] + state;
+        return LR_GOTO_CHECK[i] == nonterminal ? LR_GOTO_NEXT[i] : LR_DEFAULT_GOTO[nonterminal];
+    };
+
+    // left associative operators of higher precedence bind first, as in parse_expression
+    vector<pair<char, int>> pending_operations;
+    auto build_expression = [&](size_t node_base, size_t operation_base) {
+        size_t operand = node_base, write = node_base;
+        nodes[write++] = nodes[operand++];
+        for (size_t i = operation_base; i < operations.size(); i++) {
+            int precedence = BINARY_OPERATION_PRECEDENCE[(int)operations[i]];
+            while (!pending_operations.empty() && pending_operations.back().second >= precedence) {
+                write--;
+                nodes[write-1] = new BinaryExpressionNode(pending_operations.back().first, nodes[write-1], nodes[write]);
+                pending_operations.pop_back();
+            }
+            pending_operations.emplace_back(operations[i], precedence);
+            nodes[write++] = nodes[operand++];
+        }
+        while (!pending_operations.empty()) {
+            write--;
+            nodes[write-1] = new BinaryExpressionNode(pending_operations.back().first, nodes[write-1], nodes[write]);
+            pending_operations.pop_back();
+        }
+        nodes.resize(node_base + 1);
+        operations.resize(operation_base);
+    };
+
+    auto add_item = [&](TopLevelItem::Kind kind, FunctionDefinitionNode *function) {
+        TopLevelItem item;
+        item.kind = kind;
+        item.function = function;
+        if (kind == TopLevelItem::import) {
+            item.prototype = prototype;
+        }
+        prototype = nullptr;
+        finish_top_level_item(item);
+        results.emplace_back(item);
+    };
+
+    // the state of the topmost frame, kept apart since every step reads it
+    int state = 0;
+    while (true) {
+        INSTRUMENT_MAX("parse_items_with_tables.depth", frames.size());
+        int token = current_token;
+        int terminal = token >= 0 && token < 128 ? LR_TERMINAL_OF_TOKEN[token] : -1;
+        int action = terminal == -1 ? 0 : action_of(state, terminal);
+
+        // reductions leave the lookahead in place, so they follow each other without reading it again
+        while (action < -1) {
+            int rule = -action - 1;
+            int length = LR_RULE_LENGTH[rule], lhs = LR_RULE_LHS[rule];
+            // the first frame of the right-hand side becomes the frame of the left-hand side,
+            // its bases are already where the values of the rule begin
+            if (length > 0) {
+                frames.resize(frames.size() - length + 1);
+            } else {
+                frames.push_back({ 0, (uint32_t)nodes.size(), (uint32_t)names.size(), (uint32_t)operations.size() });
+            }
+            const LrFrame &reduced = frames.back();
+
+            switch (lhs) {
+                case lr_expression:
+                    // an operand without operators is already the expression
+                    if (operations.size() != reduced.operation_base) {
+                        build_expression(reduced.node_base, reduced.operation_base);
+                    }
+                    break;
+
+                case lr_identifierexpr:
+                    if (length == 1) {
+                        nodes.emplace_back(new VariableExpressionNode(name_of(names.back())));
+                    } else {
+                        vector<ExpressionNode *> arguments(nodes.begin() + reduced.node_base, nodes.end());
+                        nodes.resize(reduced.node_base);
+                        nodes.emplace_back(new FunctionCallExpressionNode(name_of(names[reduced.name_base]),
+                                                                          move(arguments)));
+                    }
+                    names.resize(reduced.name_base);
+                    break;
+
+                case lr_funcproto: {
+                    vector<string> arguments;
+                    for (size_t i = reduced.name_base + 1; i < names.size(); i++) {
+                        arguments.emplace_back(name_of(names[i]));
+                    }
+                    prototype = new FunctionPrototypeNode(name_of(names[reduced.name_base]), move(arguments));
+                    names.resize(reduced.name_base);
+                    break;
+                }
+
+                case lr_funcimpexpr:
+                    add_item(TopLevelItem::import, nullptr);
+                    break;
+
+                case lr_funcdefexpr:
+                    add_item(TopLevelItem::definition, new FunctionDefinitionNode(prototype, nodes.back()));
+                    nodes.pop_back();
+                    break;
+
+                case lr_toplevelexpr:
+                    add_item(TopLevelItem::expression,
+                             new FunctionDefinitionNode(new FunctionPrototypeNode("__top_level", vector<string>()),
+                                                        nodes.back()));
+                    nodes.pop_back();
+                    break;
+
+                default:
+                    break;
+            }
+
+            state = goto_of(frames[frames.size() - 2].state, lhs);
+            frames.back().state = state;
+            // the stack is back between top-level items once the list of them is reduced
+            if (frames.size() == 2) {
+                item_frames = frames;
+                item_start = token_cursor - (current_token == tok_eof ? 0 : 1);
+            }
+            action = action_of(state, terminal);
+        }
+
+        if (action > 0) {
+            state = action - 1;
+            frames.push_back({ state, (uint32_t)nodes.size(), (uint32_t)names.size(), (uint32_t)operations.size() });
+            if (token == tok_identifier) {
+                names.emplace_back(token_cursor - 1);
+            } else if (token == tok_number) {
+                nodes.emplace_back(new NumberExpressionNode(number_value));
+            } else if (BINARY_OPERATION_PRECEDENCE[token] >= 0) {
+                operations.emplace_back((char)token);
+            }
+            advance();
+            continue;
+        }
+
+        // rule 0 accepts
+        if (action == -1) {
+            return;
+        }
+
+        // the hand-written parser reports the error and recovers from it exactly as it
+        // does without tables, so the item is parsed again by it from its first token
+        for (ExpressionNode *node : nodes) {
+            delete node;
+        }
+        delete prototype;
+        prototype = nullptr;
+        nodes.clear();
+        names.clear();
+        operations.clear();
+
+        token_cursor = item_start;
+        get_next_token();
+        TopLevelItem item = parse_top_level_item();
+        if (item.kind != TopLevelItem::none) {
+            results.emplace_back(item);
+        }
+        // before the first reduction there are no frames between items yet
+        frames = item_frames.empty() ? vector<LrFrame> { { 0, 0, 0, 0 } } : item_frames;
+        state = frames.back().state;
+        item_start = token_cursor - (current_token == tok_eof ? 0 : 1);
+    }
+}
+
+vector<TopLevelItem> parse_top_level_items(const string &source, const vector<LexedToken> &tokens) {
+    INSTRUMENT_SCOPE("parse_top_level_items");
+    vector<TopLevelItem> items;
+    parse_token_range(source, tokens.data(), tokens.data() + tokens.size(), items);
+    return items;
+}
+
+vector<TopLevelItem> parse_top_level_items_parallel(const string &source, const vector<LexedToken> &tokens,
+                                                    int jobs) {
+    INSTRUMENT_SCOPE("parse_top_level_items_parallel");
+    // items after a malformed one are still separate, so a syntax error doesn't leave
+    // the rest of the input to a single thread
+    vector<size_t> starts = find_top_level_items(tokens);
+    starts.emplace_back(tokens.size());
+    size_t item_count = starts.size() - 1;
+
+    // items are split into contiguous chunks, every chunk collects its results
+    // into its own buffer, so merging them in order keeps the output deterministic
+    size_t chunk_count = min(item_count, (size_t)jobs * 8);
+    vector<vector<TopLevelItem>> chunk_results(chunk_count);
+    atomic<size_t> next_chunk(0);
+
+    auto worker = [&]() {
+        size_t chunk;
+        while ((chunk = next_chunk++) < chunk_count) {
+            INSTRUMENT_SCOPE("parse_top_level_items_parallel.chunk");
+            size_t first = item_count * chunk / chunk_count, last = item_count * (chunk+1) / chunk_count;
+            for (size_t i = first; i < last; i++) {
+                parse_token_range(source, tokens.data() + starts[i], tokens.data() + starts[i+1],
+                                  chunk_results[chunk]);
+            }
+        }
+    };
+
+    vector<thread> threads;
+    for (int i = 0; i < jobs; i++) {
+        threads.emplace_back(worker);
+    }
+    for (thread &t : threads) {
+        t.join();
+    }
+
+    vector<TopLevelItem> items;
+    for (vector<TopLevelItem> &results : chunk_results) {
+        items.insert(items.end(), results.begin(), results.end());
+    }
+    return items;
+}
+
+void log_error(const char *message) {
+    if (error_sink != nullptr) {
+        TopLevelItem item;
+        item.kind = TopLevelItem::error;
+        item.message = message;
+        error_sink->emplace_back(item);
+        return;
+    }
+    printf("error: %s\n", message);
+}
+
+
+// used as a hash-consing key, operands are already canonical nodes so they are compared by address
+struct ExpressionKey {
+    ExpressionKind kind;
+    char operation;
+    uint64_t number_bits;
+    string name;
+    const ExpressionNode *lhs, *rhs;
+
+    bool operator==(const ExpressionKey &other) const {
+        return kind == other.kind && operation == other.operation && number_bits == other.number_bits
+               && lhs == other.lhs && rhs == other.rhs && name == other.name;
+    }
+};
+
+struct ExpressionKeyHash {
+    size_t operator()(const ExpressionKey &key) const {
+        size_t h = hash<string>()(key.name);
+        h = h * 31 + key.kind;
+        h = h * 31 + (unsigned char)key.operation;
+        h = h * 31 + hash<uint64_t>()(key.number_bits);
+        h = h * 31 + hash<const void *>()(key.lhs);
+        h = h * 31 + hash<const void *>()(key.rhs);
+        return h;
+    }
+};
+
+bool fold_binary_operation(char operation, double lhs, double rhs, double &result) {
+    switch (operation) {
+        case '+': result = lhs + rhs; return true;
+        case '-': result = lhs - rhs; return true;
+        case '*': result = lhs * rhs; return true;
+        case '/': result = lhs / rhs; return true;
+        // comparisons produce 1.0 for true and 0.0 for false
+        case '<': result = lhs < rhs ? 1.0 : 0.0; return true;
+        case '>': result = lhs > rhs ? 1.0 : 0.0; return true;
+        case '=': result = lhs == rhs ? 1.0 : 0.0; return true;
+        default: return false;
+    }
+}
+
+void count_expression_graph(ExpressionNode *root, int &nodes, int &evaluations) {
+    // shared nodes are counted once, so for a tree it is simply the number of nodes
+    unordered_map<const ExpressionNode *, bool> visited;
+    vector<ExpressionNode *> stack = { root };
+    nodes = evaluations = 0;
+
+    while (!stack.empty()) {
+        ExpressionNode *node = stack.back();
+        stack.pop_back();
+        if (!visited.emplace(node, true).second) {
+            continue;
+        }
+
+        nodes++;
+        if (node->kind() == expr_binary) {
+            auto binary = static_cast<BinaryExpressionNode *>(node);
+            stack.emplace_back(binary->get_lhs());
+            stack.emplace_back(binary->get_rhs());
+            evaluations++;
+        } else if (node->kind() == expr_call) {
+            auto call = static_cast<FunctionCallExpressionNode *>(node);
+            for (ExpressionNode *argument : call->get_arguments()) {
+                stack.emplace_back(argument);
+            }
+            evaluations++;
+        }
+    }
+}
+
+ExpressionNode* optimize_expression(ExpressionNode *root, ExpressionPool *pool) {
+    // structurally identical subtrees are mapped to a single node, which also
+    // eliminates common subexpressions within the processed body
+    unordered_map<ExpressionKey, ExpressionNode *, ExpressionKeyHash> interned;
+    unordered_map<const ExpressionNode *, ExpressionNode *> optimized;
+
+    auto intern = [&](const ExpressionKey &key, ExpressionNode *(*create)(const ExpressionKey &)) {
+        auto it = interned.find(key);
+        if (it != interned.end()) {
+            return it->second;
+        }
+        ExpressionNode *node = pool->adopt(create(key));
+        interned.emplace(key, node);
+        return node;
+    };
+    auto create_number = [](const ExpressionKey &key) -> ExpressionNode * {
+        double value;
+        memcpy(&value, &key.number_bits, sizeof(value));
+        return new NumberExpressionNode(value);
+    };
+    auto create_variable = [](const ExpressionKey &key) -> ExpressionNode * {
+        return new VariableExpressionNode(key.name);
+    };
+    auto create_binary = [](const ExpressionKey &key) -> ExpressionNode * {
+        return new BinaryExpressionNode(key.operation, (ExpressionNode *)key.lhs, (ExpressionNode *)key.rhs);
+    };
+    auto number_key = [](double value) {
+        ExpressionKey key = { expr_number, 0, 0, string(), nullptr, nullptr };
+        memcpy(&key.number_bits, &value, sizeof(value));
+        return key;
+    };
+
+    // post-order traversal with an explicit stack, second member tells if children are done
+    vector<pair<ExpressionNode *, bool>> stack = { { root, false } };
+    while (!stack.empty()) {
+        ExpressionNode *node = stack.back().first;
+        bool children_done = stack.back().second;
+
+        if (!children_done) {
+            stack.back().second = true;
+            if (node->kind() == expr_binary) {
+                auto binary = static_cast<BinaryExpressionNode *>(node);
+                stack.emplace_back(binary->get_rhs(), false);
+                stack.emplace_back(binary->get_lhs(), false);
+            } else if (node->kind() == expr_call) {
+                auto call = static_cast<FunctionCallExpressionNode *>(node);
+                for (auto it = call->get_arguments().rbegin(); it != call->get_arguments().rend(); ++it) {
+                    stack.emplace_back(*it, false);
+                }
+            }
+            continue;
+        }
+        stack.pop_back();
+
+        ExpressionNode *result = nullptr;
+        switch (node->kind()) {
+            case expr_number:
+                result = intern(number_key(static_cast<NumberExpressionNode *>(node)->get_value()), create_number);
+                break;
+
+            case expr_variable: {
+                ExpressionKey key = { expr_variable, 0, 0, static_cast<VariableExpressionNode *>(node)->get_name(),
+                                      nullptr, nullptr };
+                result = intern(key, create_variable);
+                break;
+            }
+
+            case expr_binary: {
+                auto binary = static_cast<BinaryExpressionNode *>(node);
+                ExpressionNode *lhs = optimized[binary->get_lhs()];
+                ExpressionNode *rhs = optimized[binary->get_rhs()];
+
+                double value;
+                if (lhs->kind() == expr_number && rhs->kind() == expr_number
+                    && fold_binary_operation(binary->get_operation(),
+                                             static_cast<NumberExpressionNode *>(lhs)->get_value(),
+                                             static_cast<NumberExpressionNode *>(rhs)->get_value(), value)) {
+                    result = intern(number_key(value), create_number);
+                    break;
+                }
+
+                ExpressionKey key = { expr_binary, binary->get_operation(), 0, string(), lhs, rhs };
+                result = intern(key, create_binary);
+                break;
+            }
+
+            case expr_call: {
+                // calls are never merged, since imported functions may have side effects
+                auto call = static_cast<FunctionCallExpressionNode *>(node);
+                vector<ExpressionNode *> arguments;
+                for (ExpressionNode *argument : call->get_arguments()) {
+                    arguments.emplace_back(optimized[argument]);
+                }
+                result = pool->adopt(new FunctionCallExpressionNode(call->get_function_name(), arguments));
+                break;
+            }
+        }
+        optimized[node] = result;
+    }
+
+    return optimized[root];
+}
+
+OptimizationStatistics optimize_function_definition(FunctionDefinitionNode *function) {
+    INSTRUMENT_SCOPE("optimize_function_definition");
+    OptimizationStatistics stats;
+    count_expression_graph(function->get_body(), stats.nodes_before, stats.evaluations_before);
+
+    auto pool = new ExpressionPool();
+    ExpressionNode *body = optimize_expression(function->get_body(), pool);
+    function->replace_body(body, pool);
+
+    count_expression_graph(function->get_body(), stats.nodes_after, stats.evaluations_after);
+    return stats;
+}
+
+IncrementalDocument::IncrementalDocument(const string &_source) {
+    vector<LexedToken> tokens = lex_source(_source);
+    size_t item_count;
+    root = build_items(_source, tokens, find_top_level_items(tokens), item_count);
+}
+
+IncrementalDocument::~IncrementalDocument() {
+    destroy(root);
+}
+
+void IncrementalDocument::update(DocumentItem *item) {
+    item->subtree_items = 1;
+    item->subtree_length = item->text.size();
+    for (DocumentItem *child : { item->left, item->right }) {
+        if (child != nullptr) {
+            item->subtree_items += child->subtree_items;
+            item->subtree_length += child->subtree_length;
+        }
+    }
+}
+
+IncrementalDocument::DocumentItem* IncrementalDocument::merge(DocumentItem *a, DocumentItem *b) {
+    // the treap stays balanced with high probability, so recursion depth is logarithmic
+    if (a == nullptr || b == nullptr) {
+        return a != nullptr ? a : b;
+    }
+    if (a->priority > b->priority) {
+        a->right = merge(a->right, b);
+        update(a);
+        return a;
+    }
+    b->left = merge(a, b->left);
+    update(b);
+    return b;
+}
+
+void IncrementalDocument::split(DocumentItem *items, size_t count, DocumentItem *&first, DocumentItem *&second) {
+    if (items == nullptr) {
+        first = second = nullptr;
+        return;
+    }
+    size_t left_items = items->left != nullptr ? items->left->subtree_items : 0;
+    if (count <= left_items) {
+        split(items->left, count, first, items->left);
+        second = items;
+    } else {
+        split(items->right, count - left_items - 1, items->right, second);
+        first = items;
+    }
+    update(items);
+}
+
+size_t IncrementalDocument::find_item(size_t offset, size_t &item_offset) const {
+    // offsets past the end of the source belong to the last item
+    size_t index = 0;
+    item_offset = 0;
+    for (const DocumentItem *item = root; item != nullptr;) {
+        size_t left_items = item->left != nullptr ? item->left->subtree_items : 0;
+        size_t left_length = item->left != nullptr ? item->left->subtree_length : 0;
+        if (offset < item_offset + left_length) {
+            item = item->left;
+            continue;
+        }
+        if (offset < item_offset + left_length + item->text.size() || item->right == nullptr) {
+            item_offset += left_length;
+            return index + left_items;
+        }
+        index += left_items + 1;
+        item_offset += left_length + item->text.size();
+        item = item->right;
+    }
+    return 0;
+}
+
+void IncrementalDocument::destroy(DocumentItem *items) {
+    if (items == nullptr) {
+        return;
+    }
+    destroy(items->left);
+    destroy(items->right);
+    for (TopLevelItem &result : items->results) {
+        delete_top_level_item(result);
+    }
+    delete items;
+}
+
+string IncrementalDocument::get_source() const {
+    string source;
+    vector<const DocumentItem *> stack;
+    for (const DocumentItem *item = root; item != nullptr || !stack.empty(); item = item->right) {
+        for (; item != nullptr; item = item->left) {
+            stack.emplace_back(item);
+        }
+        item = stack.back();
+        stack.pop_back();
+        source += item->text;
+    }
+    return source;
+}
+
+vector<const TopLevelItem *> IncrementalDocument::get_items() const {
+    vector<const TopLevelItem *> results;
+    vector<const DocumentItem *> stack;
+    for (const DocumentItem *item = root; item != nullptr || !stack.empty(); item = item->right) {
+        for (; item != nullptr; item = item->left) {
+            stack.emplace_back(item);
+        }
+        item = stack.back();
+        stack.pop_back();
+        for (const TopLevelItem &result : item->results) {
+            results.emplace_back(&result);
+        }
+    }
+    return results;
+}
+
+IncrementalDocument::DocumentItem* IncrementalDocument::build_items(const string &text,
+                                                                   const vector<LexedToken> &tokens,
+                                                                   const vector<size_t> &starts,
+                                                                   size_t &item_count) {
+    // text without tokens is still kept, as an item without results
+    item_count = max(starts.size(), (size_t)1);
+    DocumentItem *items = nullptr;
+    for (size_t i = 0; i < item_count; i++) {
+        size_t first = starts.empty() ? 0 : starts[i];
+        size_t last = i+1 < starts.size() ? starts[i+1] : tokens.size();
+        size_t begin = i == 0 ? 0 : tokens[first].offset;
+        size_t end = i+1 < starts.size() ? tokens[last].offset : text.size();
+
+        auto item = new DocumentItem();
+        item->text = text.substr(begin, end - begin);
+        item->tokens.assign(tokens.begin() + first, tokens.begin() + last);
+        for (LexedToken &token : item->tokens) {
+            token.offset -= begin;
+        }
+        item->priority = priorities();
+        update(item);
+
+        const LexedToken *token_begin = item->tokens.data();
+        parse_token_range(item->text, token_begin, token_begin + item->tokens.size(), item->results);
+        items = merge(items, item);
+    }
+    return items;
+}
+
+ReparseStatistics IncrementalDocument::apply_edits(vector<TextEdit> edits) {
+    // applying from the back keeps offsets of the remaining edits valid
+    sort(edits.begin(), edits.end(), [](const TextEdit &a, const TextEdit &b) { return a.offset > b.offset; });
+
+    ReparseStatistics total = { 0, 0, 0 };
+    for (const TextEdit &edit : edits) {
+        ReparseStatistics stats = apply_edit(edit);
+        total.relexed_tokens += stats.relexed_tokens;
+        total.reparsed_items += stats.reparsed_items;
+    }
+    total.total_items = root->subtree_items;
+    return total;
+}
+
+ReparseStatistics IncrementalDocument::apply_edit(const TextEdit &edit) {
+    size_t edit_begin = min(edit.offset, root->subtree_length);
+    size_t edit_end = min(edit_begin + edit.length, root->subtree_length);
+
+    // the edited region starts with the item before the one holding the edit, since the
+    // inserted text may join its last token or continue its expression, and ends with the
+    // item holding the end of the edit; the first item starts at the start of the source,
+    // so an edit of leading comments and spaces is relexed from there
+    size_t region_offset, last_offset;
+    size_t first_item = find_item(edit_begin, region_offset);
+    size_t last_item = find_item(edit_end, last_offset);
+    if (first_item > 0) {
+        first_item = find_item(region_offset - 1, region_offset);
+    }
+
+    DocumentItem *before, *region, *after;
+    split(root, first_item, before, region);
+    split(region, last_item - first_item + 1, region, after);
+
+    string text;
+    vector<const DocumentItem *> stack;
+    for (const DocumentItem *item = region; item != nullptr || !stack.empty(); item = item->right) {
+        for (; item != nullptr; item = item->left) {
+            stack.emplace_back(item);
+        }
+        item = stack.back();
+        stack.pop_back();
+        text += item->text;
+    }
+    text.replace(edit_begin - region_offset, edit_end - edit_begin, edit.text);
+
+    // the region grows by the following items until lexing and item boundaries at its end
+    // are the same as before, then the items after it are still valid
+    vector<LexedToken> tokens;
+    vector<size_t> starts;
+    while (true) {
+        DocumentItem *next = after;
+        while (next != nullptr && next->left != nullptr) {
+            next = next->left;
+        }
+        auto take_next = [&]() {
+            DocumentItem *taken;
+            split(after, 1, taken, after);
+            text += taken->text;
+            region = merge(region, taken);
+        };
+
+        // lexing goes on into the next item, whose first token has to start where it did
+        string lookahead = next != nullptr ? text + next->text : text;
+        bool synchronized = next == nullptr;
+        size_t position = 0;
+        LexedToken token;
+        tokens.clear();
+        while (lex_token(lookahead, position, token) != tok_eof) {
+            if (token.offset >= text.size()) {
+                synchronized = token.offset == text.size();
+                break;
+            }
+            tokens.emplace_back(token);
+        }
+        if (!synchronized) {
+            take_next();
+            continue;
+        }
+
+        // text without tokens belongs to the item before it, or to the next one at the start
+        if (tokens.empty() && before != nullptr) {
+            DocumentItem *previous;
+            split(before, before->subtree_items - 1, before, previous);
+            text.insert(0, previous->text);
+            region_offset -= previous->text.size();
+            region = merge(previous, region);
+            continue;
+        }
+        if (tokens.empty() && next != nullptr) {
+            take_next();
+            continue;
+        }
+
+        // the last item ends where the tokens of the next one tell, so those are scanned too
+        vector<LexedToken> scanned = tokens;
+        if (next != nullptr) {
+            scanned.insert(scanned.end(), next->tokens.begin(), next->tokens.end());
+        }
+        starts.clear();
+        position = 0;
+        while (position < tokens.size()) {
+            starts.emplace_back(position);
+            position = skip_top_level_item(scanned, position);
+        }
+        if (next == nullptr || position == tokens.size()) {
+            break;
+        }
+        take_next();
+    }
+
+    destroy(region);
+    size_t item_count;
+    DocumentItem *items = build_items(text, tokens, starts, item_count);
+    root = merge(merge(before, items), after);
+    return { tokens.size(), item_count, root->subtree_items };
+}
+
+uint64_t hash_source(const string &source) {
+    // 64-bit FNV-1a, options affecting the output are mixed in as well
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](unsigned char c) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    };
+    for (char c : source) {
+        mix(c);
+    }
+    mix((unsigned char)SERIALIZED_AST_VERSION);
+    mix(optimization_enabled ? 1 : 0);
+    return hash;
+}
+
+bool write_serialized_ast(const char *path, const vector<TopLevelItem> &items, uint64_t source_hash) {
+    vector<SerializedItem> serialized_items;
+    vector<SerializedNode> nodes;
+    vector<uint32_t> indices;
+    string strings;
+
+    unordered_map<string, uint32_t> string_offsets;
+    auto add_string = [&](const string &value) {
+        auto it = string_offsets.find(value);
+        if (it != string_offsets.end()) {
+            return it->second;
+        }
+        uint32_t offset = (uint32_t)strings.size();
+        strings.append(value);
+        strings.push_back('\0');
+        string_offsets.emplace(value, offset);
+        return offset;
+    };
+
+    // shared nodes of optimized bodies are written once, so graphs stay graphs
+    unordered_map<const ExpressionNode *, uint32_t> node_indices;
+    auto add_expression = [&](ExpressionNode *root) {
+        // number the nodes first, operands before the nodes using them, then fill records
+        vector<ExpressionNode *> order, operands;
+        vector<pair<ExpressionNode *, bool>> stack = { { root, false } };
+        while (!stack.empty()) {
+            ExpressionNode *node = stack.back().first;
+            bool operands_numbered = stack.back().second;
+            stack.pop_back();
+            if (node_indices.count(node) != 0) {
+                continue;
+            }
+            if (!operands_numbered) {
+                stack.emplace_back(node, true);
+                operands.clear();
+                node->collect_operands(operands);
+                for (ExpressionNode *operand : operands) {
+                    stack.emplace_back(operand, false);
+                }
+                continue;
+            }
+            node_indices.emplace(node, (uint32_t)(nodes.size() + order.size()));
+            order.emplace_back(node);
+        }
+
+        for (ExpressionNode *node : order) {
+            SerializedNode record = { (uint8_t)node->kind(), 0, 0, 0, 0 };
+            switch (node->kind()) {
+                case expr_number: {
+                    double value = static_cast<NumberExpressionNode *>(node)->get_value();
+                    uint64_t bits;
+                    memcpy(&bits, &value, sizeof(bits));
+                    record.first = (uint32_t)bits;
+                    record.second = (uint32_t)(bits >> 32);
+                    break;
+                }
+                case expr_variable:
+                    record.first = add_string(static_cast<VariableExpressionNode *>(node)->get_name());
+                    break;
+
+                case expr_binary: {
+                    auto binary = static_cast<BinaryExpressionNode *>(node);
+                    record.operation = binary->get_operation();
+                    record.first = node_indices[binary->get_lhs()];
+                    record.second = node_indices[binary->get_rhs()];
+                    break;
+                }
+                case expr_call: {
+                    auto call = static_cast<FunctionCallExpressionNode *>(node);
+                    record.first = add_string(call->get_function_name());
+                    record.second = (uint32_t)indices.size();
+                    indices.emplace_back((uint32_t)call->get_arguments().size());
+                    for (ExpressionNode *argument : call->get_arguments()) {
+                        indices.emplace_back(node_indices[argument]);
+                    }
+                    break;
+                }
+            }
+            nodes.emplace_back(record);
+        }
+        return node_indices[root];
+    };
+
+    for (const TopLevelItem &item : items) {
+        SerializedItem record = { (uint32_t)item.kind, SERIALIZED_NONE, SERIALIZED_NONE, SERIALIZED_NONE,
+                                  item.optimized ? 1u : 0u, item.stats.nodes_before, item.stats.nodes_after,
+                                  item.stats.evaluations_before, item.stats.evaluations_after };
+        if (!item.optimized) {
+            record.nodes_before = record.nodes_after = record.evaluations_before = record.evaluations_after = 0;
+        }
+
+        FunctionPrototypeNode *prototype = item.prototype;
+        if (item.function != nullptr) {
+            prototype = item.function->get_prototype();
+            record.body = add_expression(item.function->get_body());
+        }
+        if (prototype != nullptr) {
+            record.name = add_string(prototype->get_name());
+            record.arguments = (uint32_t)indices.size();
+            indices.emplace_back((uint32_t)prototype->get_arguments().size());
+            for (const string &argument : prototype->get_arguments()) {
+                indices.emplace_back(add_string(argument));
+            }
+        }
+        if (item.kind == TopLevelItem::error) {
+            record.name = add_string(item.message);
+        }
+        serialized_items.emplace_back(record);
+    }
+
+    SerializedHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SERIALIZED_AST_MAGIC, sizeof(header.magic));
+    header.version = SERIALIZED_AST_VERSION;
+    header.byte_order = SERIALIZED_AST_BYTE_ORDER;
+    header.source_hash = source_hash;
+    header.item_count = (uint32_t)serialized_items.size();
+    header.node_count = (uint32_t)nodes.size();
+    header.index_count = (uint32_t)indices.size();
+    header.string_bytes = (uint32_t)strings.size();
+
+    auto align = [](uint64_t offset) { return (offset + 7) & ~(uint64_t)7; };
+    header.items_offset = align(sizeof(header));
+    header.nodes_offset = align(header.items_offset + serialized_items.size() * sizeof(SerializedItem));
+    header.indices_offset = align(header.nodes_offset + nodes.size() * sizeof(SerializedNode));
+    header.strings_offset = align(header.indices_offset + indices.size() * sizeof(uint32_t));
+
+    string image(header.strings_offset + strings.size(), '\0');
+    memcpy(&image[0], &header, sizeof(header));
+    if (!serialized_items.empty()) {
+        memcpy(&image[header.items_offset], serialized_items.data(), serialized_items.size() * sizeof(SerializedItem));
+    }
+    if (!nodes.empty()) {
+        memcpy(&image[header.nodes_offset], nodes.data(), nodes.size() * sizeof(SerializedNode));
+    }
+    if (!indices.empty()) {
+        memcpy(&image[header.indices_offset], indices.data(), indices.size() * sizeof(uint32_t));
+    }
+    memcpy(&image[header.strings_offset], strings.data(), strings.size());
+
+    // write into a temporary file first, so readers never see a partial file
+    string temporary_path = string(path) + ".tmp";
+    FILE *file = fopen(temporary_path.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    bool written = fwrite(image.data(), 1, image.size(), file) == image.size();
+    written = fclose(file) == 0 && written;
+    if (!written || rename(temporary_path.c_str(), path) != 0) {
+        remove(temporary_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool SerializedAst::load(const char *path) {
+    int descriptor = open(path, O_RDONLY);
+    if (descriptor < 0) {
+        return false;
+    }
+    struct stat status;
+    if (fstat(descriptor, &status) != 0 || (size_t)status.st_size < sizeof(SerializedHeader)) {
+        close(descriptor);
+        return false;
+    }
+
+    size = (size_t)status.st_size;
+    data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    close(descriptor);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    const char *base = (const char *)data;
+    header = (const SerializedHeader *)base;
+    if (memcmp(header->magic, SERIALIZED_AST_MAGIC, sizeof(header->magic)) != 0
+        || header->version != SERIALIZED_AST_VERSION || header->byte_order != SERIALIZED_AST_BYTE_ORDER) {
+        return false;
+    }
+
+    // sections must lie inside the file
+    auto fits = [this](uint64_t offset, uint64_t bytes) {
+        return offset % 8 == 0 && offset <= size && bytes <= size - offset;
+    };
+    if (!fits(header->items_offset, (uint64_t)header->item_count * sizeof(SerializedItem))
+        || !fits(header->nodes_offset, (uint64_t)header->node_count * sizeof(SerializedNode))
+        || !fits(header->indices_offset, (uint64_t)header->index_count * sizeof(uint32_t))
+        || !fits(header->strings_offset, header->string_bytes)) {
+        return false;
+    }
+
+    items = (const SerializedItem *)(base + header->items_offset);
+    nodes = (const SerializedNode *)(base + header->nodes_offset);
+    indices = (const uint32_t *)(base + header->indices_offset);
+    strings = base + header->strings_offset;
+    return validate();
+}
+
+bool SerializedAst::validate() const {
+    // strings are terminated by the end of the section at the latest
+    if (header->string_bytes > 0 && strings[header->string_bytes - 1] != '\0') {
+        return false;
+    }
+    auto is_string = [this](uint32_t offset) { return offset < header->string_bytes; };
+    // index lists are a count followed by that many entries
+    auto is_list = [this](uint32_t position) {
+        return position < header->index_count && indices[position] < header->index_count - position;
+    };
+
+    // children are written before their parents, which also rules out cycles
+    for (uint32_t i = 0; i < header->node_count; i++) {
+        const SerializedNode &node = nodes[i];
+        switch (node.kind) {
+            case expr_number:
+                break;
+
+            case expr_variable:
+                if (!is_string(node.first)) {
+                    return false;
+                }
+                break;
+
+            case expr_binary:
+                if (node.first >= i || node.second >= i) {
+                    return false;
+                }
+                break;
+
+            case expr_call:
+                if (!is_string(node.first) || !is_list(node.second)) {
+                    return false;
+                }
+                for (uint32_t k = 1; k <= indices[node.second]; k++) {
+                    if (indices[node.second + k] >= i) {
+                        return false;
+                    }
+                }
+                break;
+
+            default:
+                return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < header->item_count; i++) {
+        const SerializedItem &item = items[i];
+        switch (item.kind) {
+            case TopLevelItem::none:
+                break;
+
+            case TopLevelItem::error:
+                if (!is_string(item.name)) {
+                    return false;
+                }
+                break;
+
+            case TopLevelItem::import:
+            case TopLevelItem::definition:
+            case TopLevelItem::expression:
+                if (!is_string(item.name) || !is_list(item.arguments)) {
+                    return false;
+                }
+                for (uint32_t k = 1; k <= indices[item.arguments]; k++) {
+                    if (!is_string(indices[item.arguments + k])) {
+                        return false;
+                    }
+                }
+                if (item.kind != TopLevelItem::import && item.body >= header->node_count) {
+                    return false;
+                }
+                break;
+
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+void print_serialized_expression(const SerializedAst &ast, uint32_t index, int tab) {
+    // an explicit stack of (node, tab), so that no chain of nodes in a file overflows the call stack
+    vector<pair<uint32_t, int>> stack = { { index, tab } };
+    while (!stack.empty()) {
+        uint32_t current = stack.back().first;
+        int current_tab = stack.back().second;
+        stack.pop_back();
+        const SerializedNode &node = ast.nodes[current];
+        pad_output(current_tab);
+
+        switch (node.kind) {
+            case expr_number: {
+                uint64_t bits = ((uint64_t)node.second << 32) | node.first;
+                double value;
+                memcpy(&value, &bits, sizeof(value));
+                printf("number: %.4f\n", value);
+                break;
+            }
+            case expr_variable:
+                printf("variable: %s\n", ast.strings + node.first);
+                break;
+
+            case expr_binary:
+                printf("binary operation: %c\n", node.operation);
+                stack.emplace_back(node.second, current_tab+1);
+                stack.emplace_back(node.first, current_tab+1);
+                break;
+
+            case expr_call: {
+                printf("function name: %s\n", ast.strings + node.first);
+                pad_output(current_tab);
+                printf("arguments:\n");
+                const uint32_t *arguments = ast.indices + node.second;
+                for (uint32_t i = arguments[0]; i >= 1; i--) {
+                    stack.emplace_back(arguments[i], current_tab+1);
+                }
+                break;
+            }
+        }
+    }
+}
+
+void print_serialized_ast(const SerializedAst &ast) {
+    // mirrors print_top_level_item and the print_description methods
+    auto print_prototype = [&ast](const SerializedItem &item, int tab) {
+        pad_output(tab);
+        printf("function name: %s\n", ast.strings + item.name);
+        pad_output(tab);
+        printf("accepts arguments: [");
+        const uint32_t *arguments = ast.indices + item.arguments;
+        for (uint32_t i = 1; i <= arguments[0]; i++) {
+            if (i > 1) printf(", ");
+            printf("%s", ast.strings + arguments[i]);
+        }
+        printf("]\n");
+    };
+
+    for (uint32_t i = 0; i < ast.header->item_count; i++) {
+        const SerializedItem &item = ast.items[i];
+        switch (item.kind) {
+            case TopLevelItem::error:
+                printf("error: %s\n", ast.strings + item.name);
+                break;
+
+            case TopLevelItem::import:
+                printf("info: parsed function import declaration\n");
+                print_prototype(item, 0);
+                printf("\n");
+                break;
+
+            case TopLevelItem::definition:
+            case TopLevelItem::expression:
+                if (item.kind == TopLevelItem::definition) {
+                    printf("info: parsed function definition\n");
+                } else {
+                    printf("info: parsed top level expression\n");
+                }
+                printf("prototype:\n");
+                print_prototype(item, 1);
+                printf("body:\n");
+                print_serialized_expression(ast, item.body, 1);
+                if (item.optimized) {
+                    printf("info: optimized: nodes %d -> %d, evaluations %d -> %d\n", item.nodes_before,
+                           item.nodes_after, item.evaluations_before, item.evaluations_after);
+                }
+                printf("\n");
+                break;
+        }
+    }
+}
+
+
+string generate_benchmark_source(size_t item_count, unsigned seed) {
+    mt19937 random(seed);
+    auto below = [&](unsigned bound) { return (unsigned)(random() % bound); };
+    const char operations[] = "+-*/<>=";
+
+    string source;
+    function<void(int)> expression = [&](int depth) {
+        int operands = 1 + below(depth > 0 ? 4 : 2);
+        for (int i = 0; i < operands; i++) {
+            if (i > 0) {
+                source += ' ';
+                source += operations[below(7)];
+                source += ' ';
+            }
+            unsigned kind = depth > 0 ? below(6) : below(2);
+            if (kind == 0) {
+                source += to_string(below(1000));
+                if (below(4) == 0) {
+                    source += "." + to_string(below(100));
+                }
+            } else if (kind == 1 || kind == 2) {
+                source += "v" + to_string(below(50));
+            } else if (kind == 3 || kind == 4) {
+                source += "f" + to_string(below(20)) + "(";
+                int arguments = below(4);
+                for (int a = 0; a < arguments; a++) {
+                    if (a > 0) {
+                        source += ", ";
+                    }
+                    expression(depth - 1);
+                }
+                source += ")";
+            } else {
+                source += "(";
+                expression(depth - 1);
+                source += ")";
+            }
+        }
+    };
+
+    for (size_t item = 0; item < item_count; item++) {
+        unsigned kind = below(10);
+        if (kind < 5) {
+            source += kind == 0 ? "import func f" : "func f";
+            source += to_string(below(20)) + "(";
+            int arguments = below(5);
+            for (int a = 0; a < arguments; a++) {
+                source += (a > 0 ? ", v" : "v") + to_string(below(50));
+            }
+            source += ")";
+            if (kind == 0) {
+                source += "\n";
+                continue;
+            }
+            source += "\n    ";
+        }
+        expression(4);
+        source += "\n\n";
+    }
+    return source;
+}
+
+bool same_expression(ExpressionNode *a, ExpressionNode *b) {
+    vector<pair<ExpressionNode *, ExpressionNode *>> pending = { { a, b } };
+    while (!pending.empty()) {
+        auto [x, y] = pending.back();
+        pending.pop_back();
+        if (x->kind() != y->kind()) {
+            return false;
+        }
+
+        switch (x->kind()) {
+            case expr_number:
+                if (static_cast<NumberExpressionNode *>(x)->get_value() != static_cast<NumberExpressionNode *>(y)->get_value()) {
+                    return false;
+                }
+                break;
+
+            case expr_variable:
+                if (static_cast<VariableExpressionNode *>(x)->get_name() != static_cast<VariableExpressionNode *>(y)->get_name()) {
+                    return false;
+                }
+                break;
+
+            case expr_binary: {
+                auto bx = static_cast<BinaryExpressionNode *>(x), by = static_cast<BinaryExpressionNode *>(y);
+                if (bx->get_operation() != by->get_operation()) {
+                    return false;
+                }
+                pending.emplace_back(bx->get_lhs(), by->get_lhs());
+                pending.emplace_back(bx->get_rhs(), by->get_rhs());
+                break;
+            }
+
+            case expr_call: {
+                auto cx = static_cast<FunctionCallExpressionNode *>(x), cy = static_cast<FunctionCallExpressionNode *>(y);
+                if (cx->get_function_name() != cy->get_function_name()
+                    || cx->get_arguments().size() != cy->get_arguments().size()) {
+                    return false;
+                }
+                for (size_t i = 0; i < cx->get_arguments().size(); i++) {
+                    pending.emplace_back(cx->get_arguments()[i], cy->get_arguments()[i]);
+                }
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+bool same_top_level_item(const TopLevelItem &a, const TopLevelItem &b) {
+    if (a.kind != b.kind || a.message != b.message) {
+        return false;
+    }
+    FunctionPrototypeNode *pa = a.function != nullptr ? a.function->get_prototype() : a.prototype;
+    FunctionPrototypeNode *pb = b.function != nullptr ? b.function->get_prototype() : b.prototype;
+    if ((pa == nullptr) != (pb == nullptr)) {
+        return false;
+    }
+    if (pa != nullptr && (pa->get_name() != pb->get_name() || pa->get_arguments() != pb->get_arguments())) {
+        return false;
+    }
+    return a.function == nullptr || same_expression(a.function->get_body(), b.function->get_body());
+}
+
+void run_parser_benchmark(size_t item_count) {
+    // parses a generated program with both parsers, reports their speed and checks that
+    // they build the same items
+    string source = generate_benchmark_source(item_count, 2024);
+    printf("info: benchmark: %zu items, %zu bytes\n", item_count, source.size());
+
+    vector<LexedToken> scanned[2];
+    for (int tables = 0; tables < 2; tables++) {
+        table_lexer_enabled = tables == 1;
+        auto started = chrono::steady_clock::now();
+        scanned[tables] = lex_source(source);
+        double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+        printf("info: %s: %.2f ms, %.1f MB/s\n", tables ? "table-driven lexer" : "hand-written lexer",
+               elapsed, source.size() / max(elapsed, 1e-9) / 1000.0);
+    }
+    bool same_tokens = scanned[0].size() == scanned[1].size();
+    for (size_t i = 0; same_tokens && i < scanned[0].size(); i++) {
+        same_tokens = scanned[0][i].kind == scanned[1][i].kind && scanned[0][i].offset == scanned[1][i].offset
+                      && scanned[0][i].length == scanned[1][i].length;
+    }
+    printf("info: lexers %s\n", same_tokens ? "produced the same tokens" : "produced different tokens");
+
+    vector<LexedToken> &tokens = scanned[0];
+    printf("info: %zu tokens\n", tokens.size());
+
+    vector<TopLevelItem> results[2];
+    for (int tables = 0; tables < 2; tables++) {
+        table_parser_enabled = tables == 1;
+        auto started = chrono::steady_clock::now();
+        results[tables] = parse_top_level_items(source, tokens);
+        double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+        printf("info: %s: %.2f ms, %.1f Mtokens/s\n", tables ? "table-driven parser" : "recursive descent",
+               elapsed, tokens.size() / max(elapsed, 1e-9) / 1000.0);
+    }
+
+    bool same = results[0].size() == results[1].size();
+    for (size_t i = 0; same && i < results[0].size(); i++) {
+        same = same_top_level_item(results[0][i], results[1][i]);
+    }
+    printf("info: parsers %s\n", same ? "built the same items" : "built different items");
+
+    // with a syntax error near the top, the items after it are still split between threads
+    string broken = ")\n" + source;
+    vector<LexedToken> broken_tokens = lex_source(broken);
+    vector<TopLevelItem> sequential = parse_top_level_items(broken, broken_tokens);
+    vector<TopLevelItem> parallel = parse_top_level_items_parallel(broken, broken_tokens,
+                                                                   max(2, (int)thread::hardware_concurrency()));
+    bool same_parallel = sequential.size() == parallel.size();
+    for (size_t i = 0; same_parallel && i < sequential.size(); i++) {
+        same_parallel = same_top_level_item(sequential[i], parallel[i]);
+    }
+    printf("info: parallel parse after a syntax error: %zu items, %s\n", find_top_level_items(broken_tokens).size(),
+           same_parallel ? "same as a sequential parse" : "different from a sequential parse");
+    for (vector<TopLevelItem> *items : { &sequential, &parallel }) {
+        for (TopLevelItem &item : *items) {
+            delete_top_level_item(item);
+        }
+    }
+
+    for (vector<TopLevelItem> &items : results) {
+        for (TopLevelItem &item : items) {
+            delete_top_level_item(item);
+        }
+    }
+    table_parser_enabled = false;
+    check_incremental_reparse(source);
+    check_deep_nesting(100000);
+}
+
+void check_incremental_reparse(const string &source) {
+    // small edits which keep the items well-formed should take the same time whatever the size
+    // of the document: a number gets an operand and loses it again, and so does the comment
+    const int edit_count = 1000;
+    const string comment = "# generated program\n";
+    IncrementalDocument document(comment + source);
+    mt19937 random(2024);
+
+    auto is_number_start = [&source](size_t i) {
+        return isdigit((unsigned char)source[i]) && i > 0 && !isalnum((unsigned char)source[i-1]) && source[i-1] != '.';
+    };
+    auto started = chrono::steady_clock::now();
+    for (int i = 0; i < edit_count; i++) {
+        TextEdit insertion = { random() % comment.size(), 0, "x" };
+        if (i % 2 == 1) {
+            size_t offset = random() % source.size();
+            while (offset < source.size() && !is_number_start(offset)) {
+                offset++;
+            }
+            insertion = { comment.size() + offset, 0, "1 + " };
+        }
+        document.apply_edits({ insertion });
+        document.apply_edits({ { insertion.offset, insertion.text.size(), "" } });
+    }
+    double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+    printf("info: incremental reparse: %.3f ms per edit\n", elapsed / (2 * edit_count));
+
+    // a syntax error near the top must not make the edits after it reparse the rest of the
+    // document, the items following it start where the parser resumes after the error
+    const string broken_prefix = comment + ")\n";
+    IncrementalDocument broken(broken_prefix + source);
+    vector<LexedToken> source_tokens = lex_source(source);
+    vector<size_t> starts = find_top_level_items(source_tokens);
+    starts.emplace_back(source_tokens.size());
+    size_t longest_item = 0;
+    for (size_t i = 0; i + 1 < starts.size(); i++) {
+        longest_item = max(longest_item, starts[i+1] - starts[i]);
+    }
+    size_t most_tokens = 0, most_items = 0;
+    for (int i = 0; i < 100; i++) {
+        size_t offset = random() % source.size();
+        while (offset < source.size() && !is_number_start(offset)) {
+            offset++;
+        }
+        TextEdit insertion = { broken_prefix.size() + offset, 0, "1 + " };
+        for (const TextEdit &edit : { insertion, TextEdit { insertion.offset, insertion.text.size(), "" } }) {
+            ReparseStatistics stats = broken.apply_edits({ edit });
+            most_tokens = max(most_tokens, stats.relexed_tokens);
+            most_items = max(most_items, stats.reparsed_items);
+        }
+    }
+    // an edit relexes the item before it, the edited one and the one after it, items of the
+    // source without the error bound their size
+    bool bounded = most_items <= 4 && most_tokens <= 4 * longest_item;
+    printf("info: edits after a syntax error relexed at most %zu tokens of %zu items, %s\n", most_tokens, most_items,
+           bounded ? "only the items around them" : "more than the items around them");
+
+    // arbitrary edits of the start of the document, including its leading comment, have to
+    // leave the same items as a full parse of the edited text
+    const vector<string> insertions = { "", "x", " + 1", "\n", "#", "(", ")", ",", "func ", "f(2) * a\n" };
+    size_t prefix = source.find('\n', min(source.size(), (size_t)2000));
+    IncrementalDocument prefix_document(comment + source.substr(0, prefix));
+    bool same = true;
+    for (int i = 0; same && i < 200; i++) {
+        size_t length = prefix_document.get_source().size();
+        size_t offset = i % 4 == 0 ? random() % comment.size() : random() % (length + 1);
+        prefix_document.apply_edits({ { offset, random() % 3, insertions[random() % insertions.size()] } });
+
+        string edited = prefix_document.get_source();
+        vector<LexedToken> tokens = lex_source(edited);
+        vector<TopLevelItem> reference = parse_top_level_items(edited, tokens);
+        vector<const TopLevelItem *> items = prefix_document.get_items();
+        same = items.size() == reference.size();
+        for (size_t k = 0; same && k < items.size(); k++) {
+            same = same_top_level_item(*items[k], reference[k]);
+        }
+        for (TopLevelItem &item : reference) {
+            delete_top_level_item(item);
+        }
+    }
+    printf("info: incremental reparse %s\n", same ? "matched a full parse after every edit"
+                                                  : "differed from a full parse");
+}
+
+void check_deep_nesting(int depth) {
+    // every pair of parentheses adds a binary node, so the body is a chain as deep as the nesting
+    string source = "func deep(x) ";
+    for (int i = 0; i < depth; i++) {
+        source += "(x + ";
+    }
+    source += "x";
+    source.append(depth, ')');
+    source += "\n";
+    vector<LexedToken> tokens = lex_source(source);
+
+    vector<TopLevelItem> results[2];
+    for (int tables = 0; tables < 2; tables++) {
+        table_parser_enabled = tables == 1;
+        results[tables] = parse_top_level_items(source, tokens);
+    }
+    table_parser_enabled = false;
+    bool parsed = results[0].size() == 1 && results[0][0].kind == TopLevelItem::definition
+                  && results[1].size() == 1 && same_top_level_item(results[0][0], results[1][0]);
+
+    // the indentation of the printed tree grows quadratically with the depth, so it goes to /dev/null
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int sink = open("/dev/null", O_WRONLY);
+    dup2(sink, STDOUT_FILENO);
+    close(sink);
+    auto started = chrono::steady_clock::now();
+    for (const TopLevelItem &item : results[0]) {
+        print_top_level_item(item);
+    }
+    fflush(stdout);
+    double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    printf("info: %d nested parentheses %s, printed in %.2f ms\n", depth,
+           parsed ? "parsed the same by both parsers" : "parsed differently", elapsed);
+    for (vector<TopLevelItem> &items : results) {
+        for (TopLevelItem &item : items) {
+            delete_top_level_item(item);
+        }
+    }
+}
+
+TaskScheduler::TaskScheduler(int jobs) : workers(max(jobs, 1)) {
+    for (int i = 1; i < (int)workers.size(); i++) {
+        threads.emplace_back(&TaskScheduler::run_worker, this, i);
+    }
+}
+
+TaskScheduler::~TaskScheduler() {
+    stopping = true;
+    {
+        lock_guard<mutex> guard(idle_lock);
+        idle.notify_all();
+    }
+    for (thread &t : threads) {
+        t.join();
+    }
+}
+
+void TaskScheduler::fork(int worker, Task *task) {
+    INSTRUMENT_COUNT("TaskScheduler.forked_tasks", 1);
+    Worker &owner = workers[worker];
+    {
+        lock_guard<mutex> guard(owner.lock);
+        owner.tasks.push_back(task);
+        owner.size++;
+    }
+    queued++;
+    if (sleeping > 0) {
+        lock_guard<mutex> guard(idle_lock);
+        idle.notify_one();
+    }
+}
+
+void TaskScheduler::join(int worker, Task *task) {
+    // tasks forked later were joined already, so unless it was stolen the task is at the back
+    Worker &owner = workers[worker];
+    bool popped = false;
+    {
+        lock_guard<mutex> guard(owner.lock);
+        if (!owner.tasks.empty() && owner.tasks.back() == task) {
+            owner.tasks.pop_back();
+            owner.size--;
+            popped = true;
+        }
+    }
+    if (popped) {
+        queued--;
+        task->run(task, worker);
+        task->done.store(true, memory_order_release);
+        return;
+    }
+
+    // the task runs elsewhere, meanwhile help with the tasks of the others
+    while (!task->done.load(memory_order_acquire)) {
+        Task *other = steal(worker);
+        if (other != nullptr) {
+            other->run(other, worker);
+            other->done.store(true, memory_order_release);
+        } else {
+            this_thread::yield();
+        }
+    }
+}
+
+Task* TaskScheduler::steal(int thief) {
+    int count = (int)workers.size();
+    for (int i = 1; i < count; i++) {
+        Worker &victim = workers[(thief + i) % count];
+        if (victim.size.load(memory_order_relaxed) == 0) {
+            continue;
+        }
+        lock_guard<mutex> guard(victim.lock);
+        if (!victim.tasks.empty()) {
+            INSTRUMENT_COUNT("TaskScheduler.stolen_tasks", 1);
+            Task *task = victim.tasks.front();
+            victim.tasks.pop_front();
+            victim.size--;
+            queued--;
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+void TaskScheduler::run_worker(int worker) {
+    while (!stopping) {
+        Task *task = steal(worker);
+        if (task != nullptr) {
+            task->run(task, worker);
+            task->done.store(true, memory_order_release);
+            continue;
+        }
+
+        unique_lock<mutex> guard(idle_lock);
+        sleeping++;
+        idle.wait(guard, [&] { return queued > 0 || stopping; });
+        sleeping--;
+    }
+}
+
+Evaluator::Evaluator(int jobs) {
+    if (jobs > 1) {
+        scheduler = new TaskScheduler(jobs);
+    }
+}
+
+Evaluator::~Evaluator() {
+    delete scheduler;
+}
+
+int Evaluator::find_slot(const string &name) {
+    auto it = slot_of.find(name);
+    if (it != slot_of.end()) {
+        return it->second;
+    }
+    functions.emplace_back();
+    functions.back().name = name;
+    slot_of.emplace(name, (int)functions.size() - 1);
+    return (int)functions.size() - 1;
+}
+
+void Evaluator::compile(ExpressionNode *body, const vector<string> &arguments, vector<EvaluationNode> &nodes) {
+    // preorder walk with an explicit stack, deep expressions don't overflow the native one
+    nodes.clear();
+    vector<ExpressionNode *> stack = { body };
+    vector<ExpressionNode *> operands;
+    while (!stack.empty()) {
+        ExpressionNode *node = stack.back();
+        stack.pop_back();
+
+        EvaluationNode compiled = { node->kind(), 0, true, 1, false, 1, 0, -1, 0 };
+        operands.clear();
+        node->collect_operands(operands);
+        compiled.operand_count = (int)operands.size();
+        switch (node->kind()) {
+            case expr_number:
+                compiled.number = static_cast<NumberExpressionNode *>(node)->get_value();
+                break;
+            case expr_variable: {
+                const string &name = static_cast<VariableExpressionNode *>(node)->get_name();
+                auto found = find(arguments.begin(), arguments.end(), name);
+                compiled.index = found == arguments.end() ? -1 : (int)(found - arguments.begin());
+                break;
+            }
+            case expr_binary:
+                compiled.operation = static_cast<BinaryExpressionNode *>(node)->get_operation();
+                break;
+            case expr_call:
+                compiled.index = find_slot(static_cast<FunctionCallExpressionNode *>(node)->get_function_name());
+                break;
+        }
+        nodes.emplace_back(compiled);
+        stack.insert(stack.end(), operands.rbegin(), operands.rend());
+    }
+
+    // operands have higher positions than their node, so sizes are known when it is reached
+    for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+        int operand = i + 1;
+        for (int k = 0; k < nodes[i].operand_count; k++) {
+            nodes[i].size += nodes[operand].size;
+            operand += nodes[operand].size;
+        }
+    }
+}
+
+double Evaluator::annotate(vector<EvaluationNode> &nodes) const {
+    // bottom-up over the preorder, using the current purity and cost of the callees
+    for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+        EvaluationNode &node = nodes[i];
+        node.pure = true;
+        node.cost = 1;
+
+        double largest_operand = 0;
+        int expensive = 0, operand = i + 1;
+        for (int k = 0; k < node.operand_count; k++) {
+            node.pure = node.pure && nodes[operand].pure;
+            node.cost += nodes[operand].cost;
+            expensive += nodes[operand].cost >= FORK_COST_THRESHOLD;
+            if (k > 0) {
+                largest_operand = max(largest_operand, nodes[operand].cost);
+            }
+            operand += nodes[operand].size;
+        }
+
+        // the branches of if_func are lazy, they are never evaluated together
+        node.forkable = node.pure && expensive >= 2;
+        if (node.kind == expr_call) {
+            const FunctionSlot &callee = functions[node.index];
+            node.forkable = node.forkable && callee.kind != FunctionSlot::builtin_if;
+            node.pure = node.pure && callee.pure;
+            if (callee.kind == FunctionSlot::defined) {
+                node.cost += callee.cost;
+            } else if (callee.kind == FunctionSlot::builtin_if && node.operand_count == 3) {
+                // only one of the branches is evaluated
+                node.cost = 1 + nodes[i+1].cost + largest_operand;
+            }
+        }
+        node.cost = min(node.cost, COST_LIMIT);
+    }
+    return nodes.empty() ? 0 : nodes[0].cost;
+}
+
+void Evaluator::analyze() {
+    // purity is the greatest fixed point over the call graph: everything is pure except echo,
+    // functions without implementation and their callers, found by a worklist over the callers
+    vector<vector<int>> callers(functions.size());
+    vector<int> worklist;
+    for (int f = 0; f < (int)functions.size(); f++) {
+        FunctionSlot &function = functions[f];
+        function.pure = function.kind == FunctionSlot::defined || function.kind == FunctionSlot::builtin_if;
+        if (!function.pure) {
+            worklist.emplace_back(f);
+        }
+        for (const EvaluationNode &node : function.body) {
+            if (node.kind == expr_call) {
+                callers[node.index].emplace_back(f);
+            }
+        }
+    }
+    while (!worklist.empty()) {
+        int f = worklist.back();
+        worklist.pop_back();
+        for (int caller : callers[f]) {
+            if (functions[caller].pure) {
+                functions[caller].pure = false;
+                worklist.emplace_back(caller);
+            }
+        }
+    }
+
+    // costs are iterated from zero; they settle unless the function is recursive, then
+    // they keep growing and are taken as unbounded
+    const int rounds = 32;
+    for (FunctionSlot &function : functions) {
+        function.cost = 0;
+    }
+    vector<bool> changed(functions.size(), true);
+    for (int round = 0; round < rounds; round++) {
+        bool any_changed = false;
+        for (int f = 0; f < (int)functions.size(); f++) {
+            FunctionSlot &function = functions[f];
+            if (function.kind != FunctionSlot::defined) {
+                changed[f] = false;
+                continue;
+            }
+            double cost = annotate(function.body);
+            changed[f] = cost != function.cost;
+            any_changed = any_changed || changed[f];
+            function.cost = cost;
+        }
+        if (!any_changed) {
+            break;
+        }
+    }
+    for (int f = 0; f < (int)functions.size(); f++) {
+        if (changed[f]) {
+            functions[f].cost = COST_LIMIT;
+        }
+    }
+    for (FunctionSlot &function : functions) {
+        if (function.kind == FunctionSlot::defined) {
+            annotate(function.body);
+        }
+    }
+    analysis_outdated = false;
+}
+
+bool Evaluator::is_cancelled(const EvaluationContext &context) {
+    for (const EvaluationContext *c = &context; c != nullptr; c = c->parent) {
+        if (c->cancelled.load(memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Evaluator::fail(EvaluationContext &context, const string &message) const {
+    context.error = message;
+    return false;
+}
+
+bool Evaluator::evaluate(const EvaluationNode *node, const double *arguments, EvaluationContext &context,
+                         double &result) const {
+    switch (node->kind) {
+        case expr_number:
+            result = node->number;
+            return true;
+
+        case expr_variable:
+            if (node->index == -1) {
+                return fail(context, "unknown variable name");
+            }
+            result = arguments[node->index];
+            return true;
+
+        case expr_binary: {
+            if (context.depth >= EVALUATION_DEPTH_LIMIT) {
+                return fail(context, "evaluation nested too deeply");
+            }
+            double values[2];
+            context.depth++;
+            bool succeeded = can_fork(node, context)
+                             ? evaluate_in_parallel(node, arguments, context, values)
+                             : evaluate(node + 1, arguments, context, values[0])
+                               && evaluate(node + 1 + node[1].size, arguments, context, values[1]);
+            context.depth--;
+            if (succeeded) {
+                fold_binary_operation(node->operation, values[0], values[1], result);
+            }
+            return succeeded;
+        }
+
+        case expr_call: {
+            if (context.depth >= EVALUATION_DEPTH_LIMIT) {
+                return fail(context, "evaluation nested too deeply");
+            }
+            context.depth++;
+            bool succeeded = evaluate_call(node, arguments, context, result);
+            context.depth--;
+            return succeeded;
+        }
+    }
+    return false;
+}
+
+bool Evaluator::can_fork(const EvaluationNode *node, const EvaluationContext &context) const {
+    return node->forkable && scheduler != nullptr && context.fork_depth < FORK_DEPTH_LIMIT
+           && scheduler->queued_by(context.worker) < 2;
+}
+
+bool Evaluator::evaluate_in_parallel(const EvaluationNode *node, const double *arguments,
+                                     EvaluationContext &context, double *values) const {
+    // the operands have no side effects, so the expensive ones but the first are forked; the
+    // first failing operand in program order decides the error, as it would sequentially
+    int count = node->operand_count, expensive = 0;
+    const EvaluationNode *operand = node + 1;
+    for (int k = 0; k < count; k++, operand += operand->size) {
+        expensive += operand->cost >= FORK_COST_THRESHOLD;
+    }
+
+    unique_ptr<EvaluationTask[]> tasks(new EvaluationTask[expensive - 1]);
+    vector<int> task_of(count, -1);
+    int forked = 0;
+    bool first_expensive = true;
+    context.fork_depth++;
+    operand = node + 1;
+    for (int k = 0; k < count; k++, operand += operand->size) {
+        if (operand->cost < FORK_COST_THRESHOLD) {
+            continue;
+        }
+        if (first_expensive) {
+            first_expensive = false;
+            continue;
+        }
+        EvaluationTask &task = tasks[forked];
+        task.run = run_task;
+        task.evaluator = this;
+        task.node = operand;
+        task.arguments = arguments;
+        task.context.depth = context.depth;
+        task.context.fork_depth = context.fork_depth;
+        task.context.parent = &context;
+        task.later_begin = &tasks[0] + forked + 1;
+        task.later_end = &tasks[0] + (expensive - 1);
+        task_of[k] = forked++;
+        scheduler->fork(context.worker, &task);
+    }
+
+    int failed_at = -1;
+    operand = node + 1;
+    for (int k = 0; k < count; k++, operand += operand->size) {
+        if (task_of[k] != -1) {
+            // operands following a failed one are not needed
+            EvaluationTask &task = tasks[task_of[k]];
+            if (task.done.load(memory_order_acquire) && !task.succeeded) {
+                failed_at = k;
+                break;
+            }
+            continue;
+        }
+        if (!evaluate(operand, arguments, context, values[k])) {
+            failed_at = k;
+            break;
+        }
+    }
+    if (failed_at != -1) {
+        for (int k = failed_at + 1; k < count; k++) {
+            if (task_of[k] != -1) {
+                tasks[task_of[k]].context.cancelled = true;
+            }
+        }
+    }
+    for (int t = forked - 1; t >= 0; t--) {
+        scheduler->join(context.worker, &tasks[t]);
+    }
+    context.fork_depth--;
+
+    for (int k = 0; k < count; k++) {
+        if (task_of[k] != -1) {
+            EvaluationTask &task = tasks[task_of[k]];
+            if (!task.succeeded) {
+                context.error = task.context.error;
+                return false;
+            }
+            values[k] = task.result;
+        } else if (k == failed_at) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Evaluator::evaluate_call(const EvaluationNode *node, const double *arguments, EvaluationContext &context,
+                              double &result) const {
+    const FunctionSlot &callee = functions[node->index];
+    if (context.parent != nullptr && is_cancelled(context)) {
+        return false;
+    }
+
+    switch (callee.kind) {
+        case FunctionSlot::undefined:
+            return fail(context, "unknown function referenced: " + callee.name);
+        case FunctionSlot::imported:
+            return fail(context, "imported function has no implementation: " + callee.name);
+        default:
+            break;
+    }
+    if (node->operand_count != callee.argument_count) {
+        return fail(context, "incorrect number of arguments passed to " + callee.name);
+    }
+
+    // if_func(condition, true_branch, false_branch) evaluates only the chosen branch
+    if (callee.kind == FunctionSlot::builtin_if) {
+        const EvaluationNode *condition = node + 1, *true_branch = condition + condition->size;
+        const EvaluationNode *false_branch = true_branch + true_branch->size;
+        if (!evaluate(condition, arguments, context, result)) {
+            return false;
+        }
+        return evaluate(result != 0.0 ? true_branch : false_branch, arguments, context, result);
+    }
+
+    // arguments of most calls fit the frame, larger lists are allocated
+    double small[4];
+    unique_ptr<double[]> large;
+    double *values = small;
+    if (node->operand_count > 4) {
+        large.reset(new double[node->operand_count]);
+        values = large.get();
+    }
+    if (can_fork(node, context)) {
+        if (!evaluate_in_parallel(node, arguments, context, values)) {
+            return false;
+        }
+    } else {
+        const EvaluationNode *operand = node + 1;
+        for (int k = 0; k < node->operand_count; k++, operand += operand->size) {
+            if (!evaluate(operand, arguments, context, values[k])) {
+                return false;
+            }
+        }
+    }
+
+    if (callee.kind == FunctionSlot::builtin_echo) {
+        // impure, so it never runs in a forked task and the output keeps program order
+        echo(values[0], context);
+        result = values[0];
+        return true;
+    }
+    return evaluate(callee.body.data(), values, context, result);
+}
+
+void Evaluator::echo(double value, EvaluationContext &context) {
+    char text[64];
+    snprintf(text, sizeof(text), "%.15g\n", value);
+    context.output += text;
+}
+
+void Evaluator::run_task(Task *task, int worker) {
+    auto evaluation = static_cast<EvaluationTask *>(task);
+    evaluation->context.worker = worker;
+    evaluation->succeeded = evaluation->evaluator->evaluate(evaluation->node, evaluation->arguments,
+                                                            evaluation->context, evaluation->result);
+    if (!evaluation->succeeded) {
+        for (EvaluationTask *later = evaluation->later_begin; later != evaluation->later_end; later++) {
+            later->context.cancelled = true;
+        }
+    }
+}
+
+void Evaluator::evaluate_item(const TopLevelItem &item, string &output) {
+    switch (item.kind) {
+        case TopLevelItem::none:
+            return;
+
+        case TopLevelItem::error:
+            output += "error: " + item.message + "\n";
+            return;
+
+        case TopLevelItem::import: {
+            // echo and if_func are provided, other imports only declare the name
+            FunctionSlot &slot = functions[find_slot(item.prototype->get_name())];
+            if (slot.kind != FunctionSlot::defined) {
+                slot.argument_count = (int)item.prototype->get_arguments().size();
+                slot.kind = FunctionSlot::imported;
+                if (slot.name == "echo" && slot.argument_count == 1) {
+                    slot.kind = FunctionSlot::builtin_echo;
+                } else if (slot.name == "if_func" && slot.argument_count == 3) {
+                    slot.kind = FunctionSlot::builtin_if;
+                }
+            }
+            analysis_outdated = true;
+            return;
+        }
+
+        case TopLevelItem::definition: {
+            FunctionPrototypeNode *prototype = item.function->get_prototype();
+            int f = find_slot(prototype->get_name());
+            vector<EvaluationNode> body;
+            compile(item.function->get_body(), prototype->get_arguments(), body);
+            FunctionSlot &slot = functions[f];
+            slot.kind = FunctionSlot::defined;
+            slot.argument_count = (int)prototype->get_arguments().size();
+            slot.body.swap(body);
+            analysis_outdated = true;
+            return;
+        }
+
+        case TopLevelItem::expression: {
+            vector<EvaluationNode> body;
+            compile(item.function->get_body(), vector<string>(), body);
+            if (analysis_outdated) {
+                analyze();
+            }
+            annotate(body);
+
+            EvaluationContext context;
+            double result;
+            bool succeeded = evaluate(body.data(), nullptr, context, result);
+            output += context.output;
+            if (succeeded) {
+                char text[64];
+                snprintf(text, sizeof(text), "info: evaluated to %.15g\n", result);
+                output += text;
+            } else {
+                output += "error: " + context.error + "\n";
+            }
+            return;
+        }
+    }
 }
@@ -0,0 +1,877 @@
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cctype>
+using namespace std;
+
+
+// reads the language grammar of Lab2.2Parser.cpp, builds LALR(1) parse tables for it
+// and writes them in compressed form to an include file used by the table-driven parser
+
+// grammar symbols share one index space, terminals and nonterminals are told apart by a flag
+struct GrammarSymbol {
+    string name;
+    bool terminal;
+    // for terminals, the Token value or character the lexer returns for it
+    string token;
+};
+
+struct Rule {
+    int lhs;
+    vector<int> rhs;
+};
+
+struct Grammar {
+    vector<GrammarSymbol> symbols;
+    vector<Rule> rules;
+    map<string, int> ids;
+    // symbol 0 is the end of input, rule 0 is the augmented rule $accept ::= start
+    int start = -1;
+
+    int intern(const string &name, bool terminal, const string &token = string()) {
+        auto it = ids.find(name);
+        if (it != ids.end()) {
+            return it->second;
+        }
+        symbols.push_back({ name, terminal, token });
+        ids.emplace(name, (int)symbols.size() - 1);
+        return (int)symbols.size() - 1;
+    }
+};
+
+// LR(0) item: a rule with the position of the dot
+struct Item {
+    int rule, dot;
+    bool operator<(const Item &other) const { return rule != other.rule ? rule < other.rule : dot < other.dot; }
+    bool operator==(const Item &other) const { return rule == other.rule && dot == other.dot; }
+};
+
+struct State {
+    // the closure, the kernel items come first
+    vector<Item> items;
+    size_t kernel_size;
+    // lookahead set of every item, one bit per terminal
+    vector<uint64_t> lookaheads;
+    map<int, int> transitions;
+};
+
+struct Conflict {
+    int state, terminal;
+    string description;
+};
+
+// action encoding shared with the parser: positive values shift to state value-1,
+// negative values reduce rule -value-1 (rule 0 accepts), zero is an error
+struct ParseTables {
+    vector<vector<int>> actions, gotos;
+    vector<int> default_reductions, default_gotos;
+    vector<Conflict> conflicts;
+};
+
+// nonterminals whose reductions build nodes or items in parse_items_with_tables of Lab2.2Parser,
+// every other nonterminal only passes the values of its right-hand side on
+const vector<string> SEMANTIC_NONTERMINALS = {
+        "funcimpexpr", "funcdefexpr", "funcproto", "toplevelexpr", "identifierexpr", "expression"
+};
+// of those, the ones leaving a single value as it is, so that their unit rules build nothing either
+const vector<string> UNIT_TRANSPARENT_NONTERMINALS = { "expression" };
+
+// grammar reading routines
+static Grammar read_grammar(const char *path);
+static void parse_alternatives(Grammar &g, const string &lhs, const vector<string> &tokens, size_t &position,
+                               vector<vector<int>> &alternatives, int &helper_count);
+static Grammar inline_pass_through_rules(const Grammar &g, const vector<string> &kept,
+                                         const vector<string> &transparent, int &inlined_count);
+
+// analysis routines
+static vector<bool> find_nullable_symbols(const Grammar &g);
+static vector<uint64_t> find_first_sets(const Grammar &g, const vector<bool> &nullable);
+static vector<uint64_t> find_follow_sets(const Grammar &g, const vector<bool> &nullable, const vector<uint64_t> &first);
+static vector<State> build_lr0_automaton(const Grammar &g);
+static void compute_lalr_lookaheads(const Grammar &g, vector<State> &states, const vector<bool> &nullable,
+                                    const vector<uint64_t> &first);
+static ParseTables build_tables(const Grammar &g, const vector<State> &states);
+
+// output routines
+static string terminal_set(const Grammar &g, uint64_t set);
+static void compress_rows(const vector<vector<int>> &rows, const vector<int> &defaults,
+                          vector<int> &base, vector<int> &check, vector<int> &next);
+static bool write_tables(const char *path, const char *grammar_path, const Grammar &g,
+                         const vector<State> &states, const ParseTables &tables);
+
+
+int main(int argc, char **argv) {
+    const char *grammar_path = "Lab2.2ParserGrammar.txt";
+    const char *output_path = "Lab2.2ParserTables.inc";
+    bool verbose = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
+            verbose = true;
+        } else if ((strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0) && i+1 < argc) {
+            output_path = argv[++i];
+        } else {
+            grammar_path = argv[i];
+        }
+    }
+
+    Grammar g = read_grammar(grammar_path);
+    if (g.start == -1) {
+        printf("error: no rules in %s\n", grammar_path);
+        return 1;
+    }
+    int inlined_count;
+    g = inline_pass_through_rules(g, SEMANTIC_NONTERMINALS, UNIT_TRANSPARENT_NONTERMINALS, inlined_count);
+
+    int terminal_count = 0;
+    for (const GrammarSymbol &symbol : g.symbols) {
+        terminal_count += symbol.terminal;
+    }
+    if (terminal_count > 64) {
+        printf("error: lookahead sets are limited to 64 terminals, the grammar has %d\n", terminal_count);
+        return 1;
+    }
+
+    vector<bool> nullable = find_nullable_symbols(g);
+    vector<uint64_t> first = find_first_sets(g, nullable);
+    vector<uint64_t> follow = find_follow_sets(g, nullable, first);
+
+    vector<State> states = build_lr0_automaton(g);
+    compute_lalr_lookaheads(g, states, nullable, first);
+    ParseTables tables = build_tables(g, states);
+
+    // the augmented rule and its $accept symbol are not counted
+    printf("info: %d terminals, %d nonterminals, %d rules, %d states, %d nonterminals inlined\n",
+           terminal_count, (int)g.symbols.size() - terminal_count - 1, (int)g.rules.size() - 1, (int)states.size(),
+           inlined_count);
+    if (verbose) {
+        for (int s = 0; s < (int)g.symbols.size(); s++) {
+            if (!g.symbols[s].terminal && s != g.rules[0].lhs) {
+                printf("%s%s\n  first: %s\n  follow: %s\n", g.symbols[s].name.c_str(), nullable[s] ? " (nullable)" : "",
+                       terminal_set(g, first[s]).c_str(), terminal_set(g, follow[s]).c_str());
+            }
+        }
+    }
+    for (const Conflict &conflict : tables.conflicts) {
+        printf("conflict: state %d on %s: %s\n", conflict.state, g.symbols[conflict.terminal].name.c_str(),
+               conflict.description.c_str());
+    }
+
+    if (!write_tables(output_path, grammar_path, g, states, tables)) {
+        printf("error: can't write %s\n", output_path);
+        return 1;
+    }
+    return 0;
+}
+
+
+Grammar read_grammar(const char *path) {
+    Grammar g;
+    g.intern("$end", true, "tok_eof");
+    g.intern("$accept", false);
+
+    ifstream input(path);
+    string line;
+    vector<pair<string, vector<string>>> definitions;
+    while (getline(input, line)) {
+        size_t separator = line.find("::=");
+        if (separator == string::npos) {
+            continue;
+        }
+
+        istringstream names(line.substr(0, separator));
+        string lhs;
+        names >> lhs;
+
+        // splits the right-hand side into quoted terminals, names and punctuation
+        vector<string> tokens;
+        const string rhs = line.substr(separator + 3);
+        for (size_t i = 0; i < rhs.size(); ) {
+            if (isspace((unsigned char)rhs[i])) {
+                i++;
+            } else if (rhs[i] == '\'') {
+                size_t end = rhs.find('\'', i + 1);
+                end = end == string::npos ? rhs.size() : end + 1;
+                tokens.emplace_back(rhs.substr(i, end - i));
+                i = end;
+            } else if (isalnum((unsigned char)rhs[i]) || rhs[i] == '_') {
+                size_t end = i;
+                while (end < rhs.size() && (isalnum((unsigned char)rhs[end]) || rhs[end] == '_')) {
+                    end++;
+                }
+                tokens.emplace_back(rhs.substr(i, end - i));
+                i = end;
+            } else {
+                tokens.emplace_back(1, rhs[i++]);
+            }
+        }
+
+        // character classes describe tokens recognized by the lexer
+        if (!tokens.empty() && tokens[0] == "[") {
+            g.intern(lhs, true, "tok_" + lhs);
+            continue;
+        }
+        g.intern(lhs, false);
+        definitions.emplace_back(lhs, tokens);
+    }
+    if (definitions.empty()) {
+        return g;
+    }
+
+    g.start = g.ids[definitions[0].first];
+    g.rules.push_back({ g.ids["$accept"], { g.start } });
+
+    for (auto &definition : definitions) {
+        vector<vector<int>> alternatives;
+        size_t position = 0;
+        int helper_count = 0;
+        parse_alternatives(g, definition.first, definition.second, position, alternatives, helper_count);
+        for (vector<int> &rhs : alternatives) {
+            g.rules.push_back({ g.ids[definition.first], rhs });
+        }
+    }
+    return g;
+}
+
+void parse_alternatives(Grammar &g, const string &lhs, const vector<string> &tokens, size_t &position,
+                        vector<vector<int>> &alternatives, int &helper_count) {
+    // groups which are repeated, optional or have several alternatives become helper
+    // nonterminals named after the rule; repetitions are left recursive, as LR parsers prefer
+    alternatives.emplace_back();
+    while (position < tokens.size() && tokens[position] != ")") {
+        const string &token = tokens[position++];
+        if (token == "|") {
+            alternatives.emplace_back();
+            continue;
+        }
+
+        vector<vector<int>> group;
+        if (token == "(") {
+            parse_alternatives(g, lhs, tokens, position, group, helper_count);
+            // skip ')'
+            position++;
+        } else if (token[0] == '\'') {
+            string text = token.substr(1, token.size() - 2);
+            string token_value = text.size() == 1 ? "'" + text + "'" : "tok_" + text;
+            group.push_back({ g.intern(token, true, token_value) });
+        } else {
+            group.push_back({ g.intern(token, false) });
+        }
+
+        char repetition = position < tokens.size() ? tokens[position][0] : 0;
+        if (repetition == '*' || repetition == '+' || repetition == '?') {
+            position++;
+        } else {
+            repetition = 0;
+        }
+        if (repetition == 0 && group.size() == 1) {
+            alternatives.back().insert(alternatives.back().end(), group[0].begin(), group[0].end());
+            continue;
+        }
+
+        int helper = g.intern(lhs + "_" + to_string(++helper_count), false);
+        if (repetition == '*' || repetition == '?') {
+            g.rules.push_back({ helper, {} });
+        }
+        for (vector<int> &rhs : group) {
+            if (repetition == '*' || repetition == '+') {
+                vector<int> repeated = { helper };
+                repeated.insert(repeated.end(), rhs.begin(), rhs.end());
+                g.rules.push_back({ helper, repeated });
+            }
+            if (repetition != '*') {
+                g.rules.push_back({ helper, rhs });
+            }
+        }
+        alternatives.back().emplace_back(helper);
+    }
+}
+
+Grammar inline_pass_through_rules(const Grammar &g, const vector<string> &kept,
+                                  const vector<string> &transparent, int &inlined_count) {
+    // nonterminals which build nothing only cost the parser reductions passing values on, so
+    // their empty rules are dropped, with a copy of every rule using them that leaves them out,
+    // and the non-recursive ones, like primary ::= identifierexpr | numberexpr | parenexpr, are
+    // replaced by their alternatives wherever they are used; the list of top-level items keeps
+    // its empty rule, the table-driven parser relies on it being on the stack between items
+    vector<Rule> rules = g.rules;
+    vector<bool> removed(g.symbols.size(), false);
+    inlined_count = 0;
+
+    // every rule using symbol gets a copy for every combination of its replacements
+    auto substitute = [&rules](int symbol, const vector<vector<int>> &replacements, bool keep_rules_of_symbol) {
+        vector<Rule> expanded;
+        for (const Rule &rule : rules) {
+            if (rule.lhs == symbol && !keep_rules_of_symbol) {
+                continue;
+            }
+            vector<vector<int>> variants = { {} };
+            for (int s : rule.rhs) {
+                vector<vector<int>> extended;
+                for (const vector<int> &variant : variants) {
+                    for (const vector<int> &replacement : s == symbol ? replacements : vector<vector<int>> { { s } }) {
+                        extended.push_back(variant);
+                        extended.back().insert(extended.back().end(), replacement.begin(), replacement.end());
+                    }
+                }
+                variants.swap(extended);
+            }
+            for (vector<int> &rhs : variants) {
+                Rule copy = { rule.lhs, rhs };
+                bool useless = rule.lhs == symbol && (rhs.empty() || rhs == vector<int> { symbol });
+                if (!useless && find_if(expanded.begin(), expanded.end(), [&copy](const Rule &other) {
+                        return other.lhs == copy.lhs && other.rhs == copy.rhs;
+                    }) == expanded.end()) {
+                    expanded.emplace_back(copy);
+                }
+            }
+        }
+        rules.swap(expanded);
+    };
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int s = 0; s < (int)g.symbols.size(); s++) {
+            if (g.symbols[s].terminal || removed[s] || s == g.start || s == g.rules[0].lhs
+                || find(kept.begin(), kept.end(), g.symbols[s].name) != kept.end()) {
+                continue;
+            }
+            bool empty_rule = false, recursive = false, used_by_start = false;
+            vector<vector<int>> alternatives;
+            for (const Rule &rule : rules) {
+                bool uses = find(rule.rhs.begin(), rule.rhs.end(), s) != rule.rhs.end();
+                used_by_start = used_by_start || (uses && rule.lhs == g.start);
+                if (rule.lhs == s) {
+                    empty_rule = empty_rule || rule.rhs.empty();
+                    recursive = recursive || uses;
+                    alternatives.push_back(rule.rhs);
+                }
+            }
+
+            if (empty_rule && !used_by_start) {
+                rules.erase(remove_if(rules.begin(), rules.end(), [s](const Rule &rule) {
+                    return rule.lhs == s && rule.rhs.empty();
+                }), rules.end());
+                substitute(s, { { s }, {} }, true);
+                changed = true;
+                continue;
+            }
+            if (!recursive && !used_by_start) {
+                substitute(s, alternatives, false);
+                removed[s] = changed = true;
+                inlined_count++;
+            }
+        }
+    }
+
+    // unit rules like expression ::= identifierexpr build nothing either, so they are replaced
+    // the same way, while the nonterminal itself is kept for its other rules
+    for (int s = 0; s < (int)g.symbols.size(); s++) {
+        if (g.symbols[s].terminal
+            || find(transparent.begin(), transparent.end(), g.symbols[s].name) == transparent.end()) {
+            continue;
+        }
+        vector<vector<int>> replacements = { { s } };
+        for (const Rule &rule : rules) {
+            if (rule.lhs == s && rule.rhs.size() == 1 && rule.rhs[0] != s) {
+                replacements.push_back(rule.rhs);
+            }
+        }
+        if (replacements.size() == 1) {
+            continue;
+        }
+        substitute(s, replacements, true);
+        rules.erase(remove_if(rules.begin(), rules.end(), [s](const Rule &rule) {
+            return rule.lhs == s && rule.rhs.size() == 1;
+        }), rules.end());
+    }
+
+    // symbols are renumbered without the inlined nonterminals, keeping their order
+    Grammar result;
+    vector<int> renumbered(g.symbols.size(), -1);
+    for (int s = 0; s < (int)g.symbols.size(); s++) {
+        if (!removed[s]) {
+            renumbered[s] = result.intern(g.symbols[s].name, g.symbols[s].terminal, g.symbols[s].token);
+        }
+    }
+    for (const Rule &rule : rules) {
+        Rule copy = { renumbered[rule.lhs], {} };
+        for (int symbol : rule.rhs) {
+            copy.rhs.emplace_back(renumbered[symbol]);
+        }
+        result.rules.emplace_back(copy);
+    }
+    result.start = renumbered[g.start];
+    return result;
+}
+
+vector<bool> find_nullable_symbols(const Grammar &g) {
+    vector<bool> nullable(g.symbols.size(), false);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (const Rule &rule : g.rules) {
+            if (!nullable[rule.lhs] && all_of(rule.rhs.begin(), rule.rhs.end(), [&](int s) { return nullable[s]; })) {
+                nullable[rule.lhs] = changed = true;
+            }
+        }
+    }
+    return nullable;
+}
+
+// terminals are numbered by their order among all symbols
+static vector<int> terminal_numbers(const Grammar &g) {
+    vector<int> numbers(g.symbols.size(), -1);
+    int count = 0;
+    for (int s = 0; s < (int)g.symbols.size(); s++) {
+        if (g.symbols[s].terminal) {
+            numbers[s] = count++;
+        }
+    }
+    return numbers;
+}
+
+// FIRST of a sequence of symbols, sets whether the whole sequence is nullable
+static uint64_t sequence_first(const vector<uint64_t> &first, const vector<bool> &nullable,
+                               const int *begin, const int *end, bool &sequence_nullable) {
+    uint64_t set = 0;
+    for (const int *s = begin; s != end; s++) {
+        set |= first[*s];
+        if (!nullable[*s]) {
+            sequence_nullable = false;
+            return set;
+        }
+    }
+    sequence_nullable = true;
+    return set;
+}
+
+vector<uint64_t> find_first_sets(const Grammar &g, const vector<bool> &nullable) {
+    vector<int> numbers = terminal_numbers(g);
+    vector<uint64_t> first(g.symbols.size(), 0);
+    for (int s = 0; s < (int)g.symbols.size(); s++) {
+        if (g.symbols[s].terminal) {
+            first[s] = 1ull << numbers[s];
+        }
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (const Rule &rule : g.rules) {
+            bool rhs_nullable;
+            uint64_t set = first[rule.lhs] | sequence_first(first, nullable, rule.rhs.data(),
+                                                            rule.rhs.data() + rule.rhs.size(), rhs_nullable);
+            if (set != first[rule.lhs]) {
+                first[rule.lhs] = set;
+                changed = true;
+            }
+        }
+    }
+    return first;
+}
+
+vector<uint64_t> find_follow_sets(const Grammar &g, const vector<bool> &nullable, const vector<uint64_t> &first) {
+    vector<uint64_t> follow(g.symbols.size(), 0);
+    // the end of input follows the augmented start symbol
+    follow[g.rules[0].lhs] = 1;
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (const Rule &rule : g.rules) {
+            for (size_t i = 0; i < rule.rhs.size(); i++) {
+                int s = rule.rhs[i];
+                if (g.symbols[s].terminal) {
+                    continue;
+                }
+                bool rest_nullable;
+                uint64_t set = follow[s] | sequence_first(first, nullable, rule.rhs.data() + i + 1,
+                                                          rule.rhs.data() + rule.rhs.size(), rest_nullable);
+                if (rest_nullable) {
+                    set |= follow[rule.lhs];
+                }
+                if (set != follow[s]) {
+                    follow[s] = set;
+                    changed = true;
+                }
+            }
+        }
+    }
+    return follow;
+}
+
+// adds the items predicted by the kernel items of a state
+static void close_items(const Grammar &g, State &state) {
+    for (size_t i = 0; i < state.items.size(); i++) {
+        const Rule &rule = g.rules[state.items[i].rule];
+        if (state.items[i].dot == (int)rule.rhs.size() || g.symbols[rule.rhs[state.items[i].dot]].terminal) {
+            continue;
+        }
+        int predicted = rule.rhs[state.items[i].dot];
+        for (int r = 0; r < (int)g.rules.size(); r++) {
+            Item item = { r, 0 };
+            if (g.rules[r].lhs == predicted && find(state.items.begin(), state.items.end(), item) == state.items.end()) {
+                state.items.emplace_back(item);
+            }
+        }
+    }
+}
+
+vector<State> build_lr0_automaton(const Grammar &g) {
+    vector<State> states(1);
+    states[0].items = { { 0, 0 } };
+    states[0].kernel_size = 1;
+    close_items(g, states[0]);
+    map<vector<Item>, int> kernels = { { states[0].items, 0 } };
+
+    for (size_t s = 0; s < states.size(); s++) {
+        // kernels of successors, grouped by the symbol after the dot
+        map<int, vector<Item>> successors;
+        for (const Item &item : states[s].items) {
+            const Rule &rule = g.rules[item.rule];
+            if (item.dot < (int)rule.rhs.size()) {
+                successors[rule.rhs[item.dot]].push_back({ item.rule, item.dot + 1 });
+            }
+        }
+
+        for (auto &successor : successors) {
+            vector<Item> kernel = successor.second;
+            sort(kernel.begin(), kernel.end());
+            auto it = kernels.find(kernel);
+            if (it == kernels.end()) {
+                State state;
+                state.items = kernel;
+                state.kernel_size = kernel.size();
+                close_items(g, state);
+                it = kernels.emplace(kernel, (int)states.size()).first;
+                states.emplace_back(state);
+            }
+            states[s].transitions[successor.first] = it->second;
+        }
+    }
+    return states;
+}
+
+void compute_lalr_lookaheads(const Grammar &g, vector<State> &states, const vector<bool> &nullable,
+                             const vector<uint64_t> &first) {
+    // lookaheads are propagated over the LR(0) automaton until nothing changes, which gives
+    // the same sets as merging the states of the canonical LR(1) automaton
+    for (State &state : states) {
+        state.lookaheads.assign(state.items.size(), 0);
+    }
+    states[0].lookaheads[0] = 1;
+
+    auto item_index = [](const State &state, const Item &item) {
+        return (size_t)(find(state.items.begin(), state.items.end(), item) - state.items.begin());
+    };
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (State &state : states) {
+            for (size_t i = 0; i < state.items.size(); i++) {
+                const Rule &rule = g.rules[state.items[i].rule];
+                int dot = state.items[i].dot;
+                uint64_t lookahead = state.lookaheads[i];
+                if (dot == (int)rule.rhs.size()) {
+                    continue;
+                }
+
+                // into the successor state
+                State &target = states[state.transitions[rule.rhs[dot]]];
+                size_t j = item_index(target, { state.items[i].rule, dot + 1 });
+                if ((target.lookaheads[j] | lookahead) != target.lookaheads[j]) {
+                    target.lookaheads[j] |= lookahead;
+                    changed = true;
+                }
+
+                // into the items predicted within the state
+                if (g.symbols[rule.rhs[dot]].terminal) {
+                    continue;
+                }
+                bool rest_nullable;
+                uint64_t predicted = sequence_first(first, nullable, rule.rhs.data() + dot + 1,
+                                                    rule.rhs.data() + rule.rhs.size(), rest_nullable);
+                if (rest_nullable) {
+                    predicted |= lookahead;
+                }
+                for (size_t k = state.kernel_size; k < state.items.size(); k++) {
+                    if (state.items[k].dot == 0 && g.rules[state.items[k].rule].lhs == rule.rhs[dot]
+                        && (state.lookaheads[k] | predicted) != state.lookaheads[k]) {
+                        state.lookaheads[k] |= predicted;
+                        changed = true;
+                    }
+                }
+            }
+        }
+    }
+}
+
+ParseTables build_tables(const Grammar &g, const vector<State> &states) {
+    vector<int> numbers = terminal_numbers(g);
+    int terminal_count = *max_element(numbers.begin(), numbers.end()) + 1;
+    // nonterminals are numbered in order too, without $accept which is never a goto target
+    vector<int> nonterminal_numbers(g.symbols.size(), -1);
+    int nonterminal_count = 0;
+    for (int s = 0; s < (int)g.symbols.size(); s++) {
+        if (!g.symbols[s].terminal && s != g.rules[0].lhs) {
+            nonterminal_numbers[s] = nonterminal_count++;
+        }
+    }
+
+    ParseTables tables;
+    tables.actions.assign(states.size(), vector<int>(terminal_count, 0));
+    tables.gotos.assign(states.size(), vector<int>(nonterminal_count, -1));
+    auto rule_name = [&](int r) {
+        string text = g.symbols[g.rules[r].lhs].name + " ::=";
+        for (int s : g.rules[r].rhs) {
+            text += " " + g.symbols[s].name;
+        }
+        return text;
+    };
+
+    for (int s = 0; s < (int)states.size(); s++) {
+        const State &state = states[s];
+        for (auto &transition : state.transitions) {
+            int symbol = transition.first;
+            if (g.symbols[symbol].terminal) {
+                tables.actions[s][numbers[symbol]] = transition.second + 1;
+            } else {
+                tables.gotos[s][nonterminal_numbers[symbol]] = transition.second;
+            }
+        }
+
+        for (size_t i = 0; i < state.items.size(); i++) {
+            int r = state.items[i].rule;
+            if (state.items[i].dot != (int)g.rules[r].rhs.size()) {
+                continue;
+            }
+            for (int symbol = 0; symbol < (int)g.symbols.size(); symbol++) {
+                if (!g.symbols[symbol].terminal || !((state.lookaheads[i] >> numbers[symbol]) & 1)) {
+                    continue;
+                }
+                int &action = tables.actions[s][numbers[symbol]];
+                if (action == 0) {
+                    action = -r - 1;
+                } else if (action > 0) {
+                    // a call or an argument list extends the expression, as in the hand-written parser
+                    tables.conflicts.push_back({ s, symbol, "shift/reduce with " + rule_name(r) + ", resolved as shift" });
+                } else {
+                    int other = -action - 1;
+                    tables.conflicts.push_back({ s, symbol, "reduce/reduce between " + rule_name(other) + " and "
+                                                 + rule_name(r) + ", resolved as the first one" });
+                    action = -min(other, r) - 1;
+                }
+            }
+        }
+    }
+
+    // the most frequent reduction of a state becomes its default action, which removes
+    // most error entries; errors are then found before the next shift instead of at once
+    tables.default_reductions.assign(states.size(), 0);
+    for (int s = 0; s < (int)states.size(); s++) {
+        map<int, int> counts;
+        for (int action : tables.actions[s]) {
+            if (action < -1) {
+                counts[action]++;
+            }
+        }
+        int best = 0, best_count = 0;
+        for (auto &count : counts) {
+            if (count.second > best_count) {
+                best = count.first;
+                best_count = count.second;
+            }
+        }
+        tables.default_reductions[s] = best;
+        for (int &action : tables.actions[s]) {
+            if (action == best) {
+                action = 0;
+            }
+        }
+    }
+
+    // gotos are compressed by columns: every nonterminal has a most frequent target state
+    tables.default_gotos.assign(nonterminal_count, -1);
+    for (int n = 0; n < nonterminal_count; n++) {
+        map<int, int> counts;
+        for (int s = 0; s < (int)states.size(); s++) {
+            if (tables.gotos[s][n] != -1) {
+                counts[tables.gotos[s][n]]++;
+            }
+        }
+        int best_count = 0;
+        for (auto &count : counts) {
+            if (count.second > best_count) {
+                tables.default_gotos[n] = count.first;
+                best_count = count.second;
+            }
+        }
+        for (int s = 0; s < (int)states.size(); s++) {
+            if (tables.gotos[s][n] == tables.default_gotos[n]) {
+                tables.gotos[s][n] = -1;
+            }
+        }
+    }
+    return tables;
+}
+
+string terminal_set(const Grammar &g, uint64_t set) {
+    vector<int> numbers = terminal_numbers(g);
+    string text;
+    for (int s = 0; s < (int)g.symbols.size(); s++) {
+        if (g.symbols[s].terminal && ((set >> numbers[s]) & 1)) {
+            text += (text.empty() ? "" : " ") + g.symbols[s].name;
+        }
+    }
+    return text;
+}
+
+void compress_rows(const vector<vector<int>> &rows, const vector<int> &empty_values,
+                   vector<int> &base, vector<int> &check, vector<int> &next) {
+    // row displacement: every row is placed at the smallest offset where its significant
+    // entries fall into free slots, check tells which row a slot belongs to
+    vector<int> order(rows.size());
+    for (int r = 0; r < (int)rows.size(); r++) {
+        order[r] = r;
+    }
+    auto significant = [&](int r) {
+        int count = 0;
+        for (int value : rows[r]) {
+            count += value != empty_values[r];
+        }
+        return count;
+    };
+    stable_sort(order.begin(), order.end(), [&](int a, int b) { return significant(a) > significant(b); });
+
+    int width = rows.empty() ? 0 : (int)rows[0].size();
+    base.assign(rows.size(), 0);
+    check.clear();
+    next.clear();
+    for (int r : order) {
+        int offset = 0;
+        while (true) {
+            bool fits = true;
+            for (int column = 0; column < width && fits; column++) {
+                fits = rows[r][column] == empty_values[r] || offset + column >= (int)check.size()
+                       || check[offset + column] == -1;
+            }
+            if (fits) {
+                break;
+            }
+            offset++;
+        }
+        base[r] = offset;
+        if ((int)check.size() < offset + width) {
+            check.resize(offset + width, -1);
+            next.resize(offset + width, 0);
+        }
+        for (int column = 0; column < width; column++) {
+            if (rows[r][column] != empty_values[r]) {
+                check[offset + column] = r;
+                next[offset + column] = rows[r][column];
+            }
+        }
+    }
+}
+
+static void write_array(FILE *file, const char *type, const char *name, const vector<int> &values) {
+    fprintf(file, "static const %s %s[%d] = {", type, name, max(1, (int)values.size()));
+    for (size_t i = 0; i < values.size(); i++) {
+        fprintf(file, "%s%d,", i % 16 == 0 ? "\n    " : " ", values[i]);
+    }
+    fprintf(file, "%s\n};\n\n", values.empty() ? "\n    0" : "");
+}
+
+bool write_tables(const char *path, const char *grammar_path, const Grammar &g,
+                  const vector<State> &states, const ParseTables &tables) {
+    // the action rows share their default reduction as the empty value, the transposed
+    // goto table is compressed per nonterminal with the default target as the empty value
+    vector<int> action_base, action_check, action_next;
+    compress_rows(tables.actions, vector<int>(states.size(), 0), action_base, action_check, action_next);
+
+    int nonterminal_count = (int)tables.default_gotos.size();
+    vector<vector<int>> goto_columns(nonterminal_count, vector<int>(states.size()));
+    for (int n = 0; n < nonterminal_count; n++) {
+        for (int s = 0; s < (int)states.size(); s++) {
+            goto_columns[n][s] = tables.gotos[s][n];
+        }
+    }
+    vector<int> goto_base, goto_check, goto_next;
+    compress_rows(goto_columns, vector<int>(nonterminal_count, -1), goto_base, goto_check, goto_next);
+
+    FILE *file = fopen(path, "w");
+    if (file == nullptr) {
+        return false;
+    }
+
+    vector<int> numbers = terminal_numbers(g);
+    int terminal_count = (int)tables.actions[0].size();
+    fprintf(file, "// generated by Lab2.2ParserGenerator from %s, do not edit\n", grammar_path);
+    fprintf(file, "// %d states, %d terminals, %d nonterminals, %d rules, %d conflicts resolved\n",
+            (int)states.size(), terminal_count, nonterminal_count, (int)g.rules.size() - 1, (int)tables.conflicts.size());
+    fprintf(file, "// dense tables: %d entries, compressed: %d entries\n\n",
+            (int)states.size() * (terminal_count + nonterminal_count),
+            (int)(states.size() * 2 + action_check.size() * 2 + nonterminal_count * 2 + goto_check.size() * 2));
+
+    fprintf(file, "const int LR_STATE_COUNT = %d;\n", (int)states.size());
+    fprintf(file, "const int LR_TERMINAL_COUNT = %d;\n", terminal_count);
+    fprintf(file, "const int LR_NONTERMINAL_COUNT = %d;\n\n", nonterminal_count);
+
+    fprintf(file, "// nonterminals in goto table order, helpers introduced for groups are named after their rule\n");
+    fprintf(file, "enum LrNonterminal {\n");
+    for (int s = 0, n = 0; s < (int)g.symbols.size(); s++) {
+        if (!g.symbols[s].terminal && s != g.rules[0].lhs) {
+            fprintf(file, "    lr_%s%s\n", g.symbols[s].name.c_str(), ++n < nonterminal_count ? "," : "");
+        }
+    }
+    fprintf(file, "};\n\n");
+
+    fprintf(file, "// tokens returned by the lexer for every terminal\n");
+    fprintf(file, "static const int LR_TERMINAL_TOKENS[%d] = {\n", terminal_count);
+    for (int s = 0; s < (int)g.symbols.size(); s++) {
+        if (g.symbols[s].terminal) {
+            fprintf(file, "    %s,\n", g.symbols[s].token.c_str());
+        }
+    }
+    fprintf(file, "};\n\n");
+
+    // rule 0 is the augmented rule, its lhs is never used
+    vector<int> rule_lhs, rule_length;
+    map<int, int> nonterminal_numbers;
+    for (int s = 0, n = 0; s < (int)g.symbols.size(); s++) {
+        if (!g.symbols[s].terminal && s != g.rules[0].lhs) {
+            nonterminal_numbers[s] = n++;
+        }
+    }
+    for (const Rule &rule : g.rules) {
+        rule_lhs.emplace_back(rule.lhs == g.rules[0].lhs ? -1 : nonterminal_numbers[rule.lhs]);
+        rule_length.emplace_back((int)rule.rhs.size());
+    }
+
+    fprintf(file, "// actions: positive values shift to state value-1, negative values reduce rule -value-1\n");
+    fprintf(file, "// (rule 0 accepts), zero is an error; entry base[state]+terminal belongs to the state\n");
+    fprintf(file, "// if check holds the state, otherwise the default reduction of the state applies\n");
+    write_array(file, "int", "LR_RULE_LHS", rule_lhs);
+    write_array(file, "int", "LR_RULE_LENGTH", rule_length);
+    write_array(file, "int", "LR_DEFAULT_REDUCTION", tables.default_reductions);
+    write_array(file, "int", "LR_ACTION_BASE", action_base);
+    write_array(file, "int", "LR_ACTION_CHECK", action_check);
+    write_array(file, "int", "LR_ACTION_NEXT", action_next);
+
+    fprintf(file, "// gotos: entry base[nonterminal]+state belongs to the nonterminal if check holds it,\n");
+    fprintf(file, "// otherwise the default target of the nonterminal applies\n");
+    write_array(file, "int", "LR_DEFAULT_GOTO", tables.default_gotos);
+    write_array(file, "int", "LR_GOTO_BASE", goto_base);
+    write_array(file, "int", "LR_GOTO_CHECK", goto_check);
+    write_array(file, "int", "LR_GOTO_NEXT", goto_next);
+
+    return fclose(file) == 0;
+}
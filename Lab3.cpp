@@ -5,56 +5,465 @@
 #include <cctype>
 #include <map>
 #include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <sys/resource.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <queue>
+#include <cmath>
+#include "Instrumentation.h"
 using namespace std;
 
 
 // the symbol representing null production rule in the input file
 const char NULL_CHARACTER = '\\';
 
+// rules with more nullable symbols are split with helper symbols before null production
+// elimination, which keeps the number of generated rules linear instead of exponential
+int null_expansion_bound = 16;
 
-// .first - left-hand side; .second - right-hand side
-using ProductionRule = pair<char, string>;
-using Grammar = vector<ProductionRule>;
+
+// symbols are dense integer ids, their names are kept in a separate table
+using Symbol = int;
+
+class SymbolTable {
+    vector<string> names;
+    vector<bool> terminal;
+    unordered_map<string, Symbol> ids;
+
+public:
+    // returns the id of an already known symbol, or registers a new one
+    Symbol intern(const string &name, bool is_terminal) {
+        auto it = ids.find(name);
+        if (it != ids.end()) {
+            return it->second;
+        }
+        Symbol id = (Symbol)names.size();
+        names.emplace_back(name);
+        terminal.push_back(is_terminal);
+        ids.emplace(name, id);
+        return id;
+    }
+
+    Symbol find(const string &name) const {
+        auto it = ids.find(name);
+        return it == ids.end() ? -1 : it->second;
+    }
+
+    const string& name(Symbol symbol) const { return names[symbol]; }
+    bool is_terminal(Symbol symbol) const { return terminal[symbol]; }
+    int size() const { return (int)names.size(); }
+};
+
+// lists of rules attached to every symbol, stored in compressed form:
+// rules of symbol s are rules[offsets[s]] .. rules[offsets[s+1]-1]
+struct SymbolIndex {
+    vector<int> offsets, rules;
+
+    const int* begin(Symbol s) const { return rules.data() + offsets[s]; }
+    const int* end(Symbol s) const { return rules.data() + offsets[s+1]; }
+};
+
+// production rules are stored in an arena of parallel arrays, right-hand sides of all
+// rules are concatenated into a single buffer; an empty right-hand side is a null production
+struct RuleArena {
+    vector<Symbol> lhs;
+    // rule i occupies [rhs_offsets[i], rhs_offsets[i+1]) of rhs_symbols
+    vector<int> rhs_offsets = { 0 };
+    vector<Symbol> rhs_symbols;
+
+    int rule_count() const { return (int)lhs.size(); }
+    const Symbol* rhs_begin(int rule) const { return rhs_symbols.data() + rhs_offsets[rule]; }
+    const Symbol* rhs_end(int rule) const { return rhs_symbols.data() + rhs_offsets[rule+1]; }
+    int rhs_size(int rule) const { return rhs_offsets[rule+1] - rhs_offsets[rule]; }
+
+    void add_rule(Symbol left, const Symbol *begin, const Symbol *end) {
+        lhs.emplace_back(left);
+        rhs_symbols.insert(rhs_symbols.end(), begin, end);
+        rhs_offsets.emplace_back((int)rhs_symbols.size());
+        lhs_index_valid = false;
+    }
+
+    void add_rule(Symbol left, const vector<Symbol> &rhs) {
+        add_rule(left, rhs.data(), rhs.data() + rhs.size());
+    }
+
+    void remove_last_rule() {
+        lhs.pop_back();
+        rhs_offsets.pop_back();
+        rhs_symbols.resize(rhs_offsets.back());
+        lhs_index_valid = false;
+    }
+
+    // keeps only rules satisfying the predicate, compacting the arena in place
+    template<typename Predicate>
+    void retain_rules(Predicate keep) {
+        int kept = 0, write = 0;
+        for (int rule = 0; rule < rule_count(); rule++) {
+            if (!keep(rule)) {
+                continue;
+            }
+            int begin = rhs_offsets[rule], size = rhs_size(rule);
+            copy(rhs_symbols.begin() + begin, rhs_symbols.begin() + begin + size, rhs_symbols.begin() + write);
+            lhs[kept] = lhs[rule];
+            rhs_offsets[kept] = write;
+            write += size;
+            kept++;
+        }
+        lhs.resize(kept);
+        rhs_offsets.resize(kept + 1);
+        rhs_offsets[kept] = write;
+        rhs_symbols.resize(write);
+        lhs_index_valid = false;
+    }
+
+    // rules grouped by their left-hand side, rebuilt lazily after the rules change
+    const SymbolIndex& rules_by_lhs(int symbol_count) const;
+
+    size_t memory_bytes() const {
+        return (lhs.capacity() + rhs_offsets.capacity() + rhs_symbols.capacity()) * sizeof(int)
+               + (lhs_index.offsets.capacity() + lhs_index.rules.capacity()) * sizeof(int);
+    }
+
+private:
+    mutable SymbolIndex lhs_index;
+    mutable bool lhs_index_valid = false;
+};
+
+// conversion stages rewrite the rules of a grammar in place, the symbol table is only extended
+struct Grammar : RuleArena {
+    SymbolTable symbols;
+    Symbol start = -1;
+
+    // moves the rules out of the grammar, leaving its symbols untouched
+    RuleArena take_rules() {
+        RuleArena rules = move(static_cast<RuleArena &>(*this));
+        static_cast<RuleArena &>(*this) = RuleArena();
+        return rules;
+    }
+
+    const SymbolIndex& rules_by_lhs() const { return RuleArena::rules_by_lhs(symbols.size()); }
+};
 
 
 // i/o routine
-Grammar read_grammar();
+Grammar read_grammar(istream &input);
 void show_grammar(const Grammar &g);
 
-// context-free grammar conversion
-Grammar eliminate_null_productions(const Grammar &g);
-Grammar eliminate_unit_productions(const Grammar &g);
-Grammar eliminate_useless_symbols(const Grammar &g);
-Grammar transform_into_cnf(const Grammar &g);
+// grammar analyses, each runs in time linear in the grammar size; the number of worklist
+// iterations is returned to the caller, which counts it under the name of its own stage
+SymbolIndex index_rules_by_rhs(const Grammar &g);
+vector<bool> derive_symbols(const Grammar &g, const SymbolIndex &occurrences, vector<bool> derived, int &iterations);
+vector<bool> find_nullable_symbols(const Grammar &g, int &iterations);
+vector<bool> find_productive_symbols(const Grammar &g, int &iterations);
+vector<bool> find_accessible_symbols(const Grammar &g, int &iterations);
+
+// context-free grammar conversion, each stage transforms the grammar in place
+void eliminate_null_productions(Grammar &g);
+void eliminate_unit_productions(Grammar &g);
+void eliminate_useless_symbols(Grammar &g);
+void transform_into_cnf(Grammar &g);
+
+// profiling routines
+long peak_memory_kb();
+void reset_peak_memory();
+
+
+// shared packed parse forest: a node is a nonterminal spanning a part of the input,
+// packed nodes are its alternative derivations A -> BC, one per split point and rule
+struct ParseForest {
+    struct Node {
+        // -1 for intermediate nodes standing for a prefix of a rule
+        Symbol symbol;
+        int begin, length;
+        // range of packed nodes, empty for nodes deriving a single terminal
+        int first_packed, packed_count;
+    };
+    // children of a packed node, as indices of nodes; -1 is a missing child and
+    // a value v <= -2 is the terminal at input position -2-v
+    vector<pair<int, int>> packed;
+    vector<Node> nodes;
+    // number of parse trees represented by the forest, may become infinite
+    double trees = 0;
+};
+
+// CYK recognizer for grammars in Chomsky normal form, every cell of the table is a bitset
+// over nonterminals and rule application is done as bitset operations over pair tables
+class CykParser {
+    const Grammar &g;
+    int nonterminal_count = 0;
+    size_t words = 0;
+    // symbol -> bit position for nonterminals, -1 for terminals, and back
+    vector<int> bit_of;
+    vector<Symbol> symbol_of;
+    // terminal symbol -> offset of the bitset of nonterminals deriving it, or -1
+    vector<long long> terminal_heads;
+    // for every B: bitset of all C with a rule A -> BC, and (C, offset of the bitset of such A)
+    // pairs sorted by C; bitsets are stored in heads
+    vector<uint64_t> right_masks;
+    vector<vector<pair<int, size_t>>> pair_heads;
+    vector<uint64_t> heads;
+
+    // triangular table, cell (i, l) describes the part of the input of length l starting at i
+    int length = 0;
+    vector<Symbol> input;
+    vector<uint64_t> table;
+    vector<size_t> length_offsets;
+
+    uint64_t* cell(int i, int l) { return &table[(length_offsets[l] + i) * words]; }
+    const uint64_t* cell(int i, int l) const { return &table[(length_offsets[l] + i) * words]; }
+    const uint64_t* heads_of(int b, int c) const;
+    void fill_cell(int i, int l);
+
+public:
+    CykParser(const Grammar &_g);
+
+    // fills the table, anti-diagonals are split between threads
+    bool recognize(const vector<Symbol> &word, int threads);
+    // builds the forest of derivations of the last recognized input
+    ParseForest build_forest() const;
+    void show_tree(const ParseForest &forest, int node, string &out) const;
+};
+
+// Earley parser working on any grammar as it was read, with Leo's deterministic reduction
+// paths making right recursion linear; chart columns are consecutive ranges of one item arena
+class EarleyParser {
+    struct Item {
+        // dotted rule and the column where the rule was predicted
+        int position, origin;
+    };
+    struct LeoItem {
+        // topmost item of the deterministic reduction path and the first item on it
+        Item top, first;
+    };
+
+    const Grammar &g;
+    vector<bool> nullable;
+    // dotted rules: rule r with the dot after d symbols is rule_positions[r] + d; the last
+    // position belongs to the augmented rule S' -> S
+    vector<int> rule_positions;
+    vector<Symbol> next_symbol, position_lhs;
+    int accept_position = 0;
+
+    vector<Symbol> input;
+    vector<Item> items;
+    vector<size_t> column_offsets;
+    // items of a column waiting for a nonterminal, as (symbol, item index) sorted by symbol
+    vector<pair<Symbol, int>> waiting;
+    vector<size_t> waiting_offsets;
+    // (column, symbol) -> index of its Leo item, or -1 when the reduction is not deterministic
+    unordered_map<uint64_t, int> leo_index;
+    vector<LeoItem> leo_items;
+
+    // recognized spans (symbol, begin, end), only kept when a forest is requested
+    bool keep_spans = false;
+    unordered_set<uint64_t> spans;
+    unordered_map<uint64_t, vector<int>> span_begins;
+
+    uint64_t column_key(int column, Symbol symbol) const { return (uint64_t)symbol * (input.size() + 1) + column; }
+    int leo_item(int column, Symbol symbol);
+    uint64_t span_key(Symbol symbol, int begin, int end) const {
+        return ((uint64_t)symbol * (input.size() + 1) + begin) * (input.size() + 1) + end;
+    }
+    void add_span(Symbol symbol, int begin, int end);
+
+public:
+    EarleyParser(const Grammar &_g);
 
+    bool recognize(const vector<Symbol> &word, bool with_forest);
+    size_t item_count() const { return items.size(); }
+    // builds the forest of the last input recognized with_forest
+    ParseForest build_forest() const;
+    void show_tree(const ParseForest &forest, string &out) const;
+};
 
-int main() {
-    freopen("Lab3Input15.txt", "r", stdin);
-    Grammar g = read_grammar();
+// counts parse trees in a forest, cyclic derivations give an infinite number of trees
+double count_trees(const ParseForest &forest);
+// chooses for every node the derivation of the smallest height, which is always finite
+vector<int> find_shortest_derivations(const ParseForest &forest);
 
-    g = eliminate_null_productions(g);
-    g = eliminate_unit_productions(g);
-    g = eliminate_useless_symbols(g);
-    g = transform_into_cnf(g);
+// synchronizes threads after every anti-diagonal of the CYK table
+class Barrier {
+    mutex lock;
+    condition_variable released;
+    int count, waiting = 0, generation = 0;
+
+public:
+    Barrier(int _count) : count(_count) {}
+
+    void wait() {
+        unique_lock<mutex> guard(lock);
+        int arrived_generation = generation;
+        if (++waiting == count) {
+            waiting = 0;
+            generation++;
+            released.notify_all();
+            return;
+        }
+        released.wait(guard, [&] { return generation != arrived_generation; });
+    }
+};
+
+
+// other programs include this file to reuse the grammar routines, defining FLPC_NO_MAIN
+#ifndef FLPC_NO_MAIN
+int main(int argc, char **argv) {
+    const char *input_path = "Lab3Input15.txt";
+    bool show_profile = false, show_forest = false, use_earley = false, benchmark = false;
+    int jobs = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--timings") == 0
+            || strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--profile") == 0) {
+            show_profile = true;
+        } else if ((strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--null-bound") == 0) && i+1 < argc) {
+            null_expansion_bound = min(max(atoi(argv[++i]), 2), 62);
+        } else if ((strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0) && i+1 < argc) {
+            jobs = atoi(argv[++i]);
+            if (jobs <= 0) {
+                jobs = max(1, (int)thread::hardware_concurrency());
+            }
+        } else if (strcmp(argv[i], "--forest") == 0) {
+            show_forest = true;
+        } else if (strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "--earley") == 0) {
+            use_earley = true;
+        } else if (strcmp(argv[i], "--benchmark") == 0) {
+            benchmark = true;
+        } else {
+            input_path = argv[i];
+        }
+    }
+
+    freopen(input_path, "r", stdin);
+    Grammar g;
+
+    // runs a conversion stage, optionally reporting to stderr its time, the peak resident
+    // memory while it ran, and the size of the resulting grammar
+    auto run_stage = [&](const char *name, void (*stage)(Grammar &)) {
+        reset_peak_memory();
+        auto started = chrono::steady_clock::now();
+        stage(g);
+        double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+        if (show_profile) {
+            cerr << name << ": " << elapsed << " ms, peak " << peak_memory_kb() << " KB, "
+                 << g.rule_count() << " rules, " << g.symbols.size() << " symbols, "
+                 << g.memory_bytes() / 1024 << " KB of rules\n";
+        }
+    };
+
+    run_stage("read_grammar", [](Grammar &g) { g = read_grammar(cin); });
+    // the earley parser needs no conversion and works on the grammar as it was read
+    Grammar original = g;
+
+    run_stage("eliminate_null_productions", eliminate_null_productions);
+    run_stage("eliminate_unit_productions", eliminate_unit_productions);
+    run_stage("eliminate_useless_symbols", eliminate_useless_symbols);
+    run_stage("transform_into_cnf", transform_into_cnf);
 
     show_grammar(g);
+
+    // lines following the grammar are strings to be recognized, by default with the converted
+    // grammar, or with the earley parser on the original one; --benchmark runs both
+    CykParser parser(g);
+    EarleyParser earley(original);
+    string line;
+    while (getline(cin, line)) {
+        if (line.empty()) {
+            continue;
+        }
+
+        vector<Symbol> word, original_word;
+        for (char c : line) {
+            word.emplace_back(g.symbols.find(string(1, c)));
+            original_word.emplace_back(original.symbols.find(string(1, c)));
+        }
+
+        bool accepted = false;
+        double cyk_elapsed = 0, earley_elapsed = 0;
+        if (!use_earley || benchmark) {
+            auto started = chrono::steady_clock::now();
+            accepted = parser.recognize(word, jobs);
+            cyk_elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+        }
+        if (use_earley || benchmark) {
+            auto started = chrono::steady_clock::now();
+            bool earley_accepted = earley.recognize(original_word, use_earley && show_forest);
+            earley_elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+            if (benchmark && earley_accepted != accepted) {
+                cerr << "benchmark: parsers disagree on " << line << '\n';
+            }
+            accepted = use_earley ? earley_accepted : accepted;
+        }
+
+        if (benchmark) {
+            cerr << "benchmark: " << word.size() << " symbols, cyk " << cyk_elapsed << " ms with "
+                 << g.rule_count() << " rules, earley " << earley_elapsed << " ms with "
+                 << original.rule_count() << " rules and " << earley.item_count() << " items\n";
+        } else if (show_profile) {
+            cerr << "recognize: " << (use_earley ? earley_elapsed : cyk_elapsed) << " ms, "
+                 << word.size() << " symbols\n";
+        }
+
+        cout << line << ": " << (accepted ? "accepted" : "rejected");
+        if (accepted && show_forest) {
+            ParseForest forest = use_earley ? earley.build_forest() : parser.build_forest();
+            string tree;
+            if (use_earley) {
+                earley.show_tree(forest, tree);
+            } else {
+                parser.show_tree(forest, 0, tree);
+            }
+            cout << ", " << forest.nodes.size() << " forest nodes, " << forest.packed.size() << " packed nodes, "
+                 << forest.trees << " parse trees\n" << tree;
+        }
+        cout << '\n';
+    }
     return 0;
 }
+#endif
 
 
-Grammar read_grammar() {
-    vector<pair<char, string>> grammar;
+Grammar read_grammar(istream &input) {
+    Grammar grammar;
+    const Symbol null_symbol = -1;
+
+    // a symbol is either a single letter, or a nonterminal name enclosed in angle brackets (<name>);
+    // lowercase letters are terminals
+    auto read_symbol = [&grammar](const string &line, int &i) -> Symbol {
+        if (line[i] == NULL_CHARACTER) {
+            i++;
+            return null_symbol;
+        }
+        if (line[i] == '<') {
+            size_t close = line.find('>', i);
+            if (close == string::npos) {
+                close = line.size();
+            }
+            string name = line.substr(i+1, close-i-1);
+            i = (int)close + 1;
+            return grammar.symbols.intern(name, false);
+        }
+        char c = line[i++];
+        return grammar.symbols.intern(string(1, c), islower(c) != 0);
+    };
 
     // read input line by line, finish when encountering an empty line
     string line;
-    while (getline(cin, line) && !line.empty()) {
+    while (getline(input, line) && !line.empty()) {
         int length = (int)line.size();
 
-        // save left hand-side character
-        char lhs = line[0];
+        // save left hand-side symbol
+        int i = 0;
+        Symbol lhs = read_symbol(line, i);
 
         // skip arrow (->) characters and optional spaces around it
-        int i = 1;
         while (i < length && isspace(line[i])) {
             i++;
         }
@@ -68,212 +477,507 @@ Grammar read_grammar() {
             }
 
             // cut right hand-side of the production rule
-            int l = 0;
-            while ((i+l) < length && (isalpha(line[i+l]) || line[i+l] == NULL_CHARACTER)) {
-                l++;
+            vector<Symbol> rhs;
+            int begin = i;
+            while (i < length && (isalpha(line[i]) || line[i] == NULL_CHARACTER || line[i] == '<')) {
+                Symbol symbol = read_symbol(line, i);
+                if (symbol != null_symbol) {
+                    rhs.emplace_back(symbol);
+                }
             }
-            if (l != 0) {
-                grammar.emplace_back(lhs, line.substr(i, l));
+            if (i != begin) {
+                grammar.add_rule(lhs, rhs);
             }
-            i += l;
         }
     }
 
+    // the start symbol is S, or the first left-hand side if there is no S
+    grammar.start = grammar.symbols.find("S");
+    if (grammar.start == -1 && grammar.rule_count() > 0) {
+        grammar.start = grammar.lhs[0];
+    }
     return grammar;
 }
 
 void show_grammar(const Grammar &g) {
-    for (const pair<char, string> &rule : g) {
-        cout << rule.first << " -> " << rule.second << '\n';
+    auto show_symbol = [&g](Symbol symbol) {
+        const string &name = g.symbols.name(symbol);
+        if (name.size() == 1) {
+            cout << name;
+        } else {
+            cout << '<' << name << '>';
+        }
+    };
+
+    for (int rule = 0; rule < g.rule_count(); rule++) {
+        show_symbol(g.lhs[rule]);
+        cout << " -> ";
+        if (g.rhs_size(rule) == 0) {
+            cout << NULL_CHARACTER;
+        }
+        for (const Symbol *s = g.rhs_begin(rule); s != g.rhs_end(rule); s++) {
+            show_symbol(*s);
+        }
+        cout << '\n';
     }
 }
 
-Grammar eliminate_null_productions(const Grammar &g) {
-    map<char, bool> nullable;
-    nullable[NULL_CHARACTER] = true;
+const SymbolIndex& RuleArena::rules_by_lhs(int symbol_count) const {
+    if (lhs_index_valid && (int)lhs_index.offsets.size() == symbol_count + 1) {
+        return lhs_index;
+    }
 
-    // define a predicate to check if a symbol is "nullable"
-    auto is_symbol_nullable = [&nullable](char c){ return nullable[c]; };
+    // counting sort of rules by their left-hand side
+    SymbolIndex &index = lhs_index;
+    index.offsets.assign(symbol_count + 1, 0);
+    for (int rule = 0; rule < rule_count(); rule++) {
+        index.offsets[lhs[rule] + 1]++;
+    }
+    for (int s = 0; s < symbol_count; s++) {
+        index.offsets[s+1] += index.offsets[s];
+    }
 
-    // determine all "nullable" characters
-    bool finished = false;
-    while (!finished) {
-        finished = true;
+    index.rules.resize(rule_count());
+    vector<int> position(index.offsets.begin(), index.offsets.end() - 1);
+    for (int rule = 0; rule < rule_count(); rule++) {
+        index.rules[position[lhs[rule]]++] = rule;
+    }
+    lhs_index_valid = true;
+    return index;
+}
 
-        for (const ProductionRule &rule : g) {
-            // don't recompute, just skip it
-            if (nullable[rule.first]) {
-                continue;
-            }
+SymbolIndex index_rules_by_rhs(const Grammar &g) {
+    // a rule is listed once for every occurrence of the symbol on its right-hand side
+    SymbolIndex index;
+    index.offsets.assign(g.symbols.size() + 1, 0);
+    for (Symbol s : g.rhs_symbols) {
+        index.offsets[s + 1]++;
+    }
+    for (int s = 0; s < g.symbols.size(); s++) {
+        index.offsets[s+1] += index.offsets[s];
+    }
 
-            bool all_nullable = all_of(rule.second.begin(), rule.second.end(), is_symbol_nullable);
-            if (all_nullable) {
-                nullable[rule.first] = true;
-                finished = false;
-            }
+    index.rules.resize(g.rhs_symbols.size());
+    vector<int> position(index.offsets.begin(), index.offsets.end() - 1);
+    for (int rule = 0; rule < g.rule_count(); rule++) {
+        for (const Symbol *s = g.rhs_begin(rule); s != g.rhs_end(rule); s++) {
+            index.rules[position[*s]++] = rule;
         }
     }
+    return index;
+}
 
-    // remove production rules containing "nullable" characters
-    vector<ProductionRule> new_rules;
-    for (auto rule : g) {
-        bool contains_nullable = any_of(rule.second.begin(), rule.second.end(), is_symbol_nullable);
+vector<bool> derive_symbols(const Grammar &g, const SymbolIndex &occurrences, vector<bool> derived, int &iterations) {
+    // a left-hand side becomes derived once every symbol on the right-hand side of one of its
+    // rules is derived; every rule keeps a counter of symbols still pending, and newly derived
+    // symbols are put into a worklist which decrements counters of rules mentioning them
+    vector<int> pending(g.rule_count(), 0);
+    vector<Symbol> worklist;
+    iterations = 0;
 
-        if (!contains_nullable) {
-            new_rules.emplace_back(rule);
-            continue;
+    for (int rule = 0; rule < g.rule_count(); rule++) {
+        for (const Symbol *s = g.rhs_begin(rule); s != g.rhs_end(rule); s++) {
+            if (!derived[*s]) {
+                pending[rule]++;
+            }
+        }
+    }
+    for (int rule = 0; rule < g.rule_count(); rule++) {
+        if (pending[rule] == 0 && !derived[g.lhs[rule]]) {
+            derived[g.lhs[rule]] = true;
+            worklist.emplace_back(g.lhs[rule]);
         }
+    }
 
-        // ignore productions of form N -> \
+    while (!worklist.empty()) {
+        iterations++;
+        Symbol s = worklist.back();
+        worklist.pop_back();
 
-        if (rule.second[0] == NULL_CHARACTER) {
-            continue;
+        for (const int *rule = occurrences.begin(s); rule != occurrences.end(s); rule++) {
+            if (--pending[*rule] == 0 && !derived[g.lhs[*rule]]) {
+                derived[g.lhs[*rule]] = true;
+                worklist.emplace_back(g.lhs[*rule]);
+            }
         }
+    }
+    return derived;
+}
+
+vector<bool> find_nullable_symbols(const Grammar &g, int &iterations) {
+    return derive_symbols(g, index_rules_by_rhs(g), vector<bool>(g.symbols.size(), false), iterations);
+}
+
+vector<bool> find_productive_symbols(const Grammar &g, int &iterations) {
+    // terminals are productive by themselves
+    vector<bool> productive(g.symbols.size(), false);
+    for (Symbol s = 0; s < g.symbols.size(); s++) {
+        productive[s] = g.symbols.is_terminal(s);
+    }
+    return derive_symbols(g, index_rules_by_rhs(g), productive, iterations);
+}
+
+vector<bool> find_accessible_symbols(const Grammar &g, int &iterations) {
+    // graph search from the start symbol, every rule is visited at most once
+    const SymbolIndex &rules = g.rules_by_lhs();
+    vector<bool> accessible(g.symbols.size(), false);
+    vector<Symbol> worklist;
+    iterations = 0;
+    if (g.start != -1) {
+        accessible[g.start] = true;
+        worklist.emplace_back(g.start);
+    }
 
-        // handle productions of form X -> aNb
-        new_rules.emplace_back(rule);
-        string &s = rule.second;
-        // verifying each segment of length l starting from position i
-        for (int l = 1; l <= ((int)s.size()-1); l++) {
-            for (int i = 0; i < ((int)s.size()-l+1); i++) {
-                bool is_segment_nullable = all_of(s.begin()+i, s.begin()+i+l, is_symbol_nullable);
-                if (is_segment_nullable) {
-                    string new_rhs = s.substr(0, i) + s.substr(i+l);
-                    new_rules.emplace_back(rule.first, new_rhs);
+    while (!worklist.empty()) {
+        iterations++;
+        Symbol lhs = worklist.back();
+        worklist.pop_back();
+
+        for (const int *rule = rules.begin(lhs); rule != rules.end(lhs); rule++) {
+            for (const Symbol *s = g.rhs_begin(*rule); s != g.rhs_end(*rule); s++) {
+                if (!g.symbols.is_terminal(*s) && !accessible[*s]) {
+                    accessible[*s] = true;
+                    worklist.emplace_back(*s);
                 }
             }
         }
     }
-
-    return new_rules;
+    return accessible;
 }
 
-Grammar eliminate_unit_productions(const Grammar &g) {
-    set<ProductionRule> new_rules, old_rules(g.begin(), g.end());
+void eliminate_null_productions(Grammar &g) {
+    INSTRUMENT_SCOPE("eliminate_null_productions");
+    int nullable_iterations;
+    vector<bool> nullable = find_nullable_symbols(g, nullable_iterations);
+    INSTRUMENT_COUNT("eliminate_null_productions.nullable_iterations", nullable_iterations);
+    const RuleArena old = g.take_rules();
 
-    // do this continuously while there are some unit productions
-    bool finished = false;
-    while (!finished) {
-        finished = true;
+    // emitted rules are kept in a hash set by their index, so duplicates are dropped right away
+    auto hash_rule = [&g](int rule) {
+        size_t h = (size_t)g.lhs[rule];
+        for (const Symbol *s = g.rhs_begin(rule); s != g.rhs_end(rule); s++) {
+            h = h * 1000003 + (size_t)*s;
+        }
+        return h;
+    };
+    auto equal_rules = [&g](int a, int b) {
+        return g.lhs[a] == g.lhs[b]
+               && equal(g.rhs_begin(a), g.rhs_end(a), g.rhs_begin(b), g.rhs_end(b));
+    };
+    unordered_set<int, decltype(hash_rule), decltype(equal_rules)> emitted(1024, hash_rule, equal_rules);
+
+    // adds every variant of the rule with some subset of its nullable symbols omitted,
+    // subsets are enumerated as bitmasks over the nullable positions
+    vector<int> bit_of;
+    vector<Symbol> buffer;
+    auto expand_rule = [&](Symbol lhs, const Symbol *begin, const Symbol *end) {
+        int bits = 0;
+        bit_of.clear();
+        for (const Symbol *s = begin; s != end; s++) {
+            bit_of.emplace_back(nullable[*s] ? bits++ : -1);
+        }
+        INSTRUMENT_COUNT("eliminate_null_productions.variants", 1ull << bits);
 
-        // traverse production rules list and find if there are unit productions
-        for (auto &rule : old_rules) {
-            // leave rules that are not unit productions (A -> B)
-            if (rule.second.size() > 1 || !isupper(rule.second[0])) {
-                new_rules.emplace(rule);
+        for (uint64_t mask = 0; mask < (1ull << bits); mask++) {
+            buffer.clear();
+            for (int i = 0; i < (int)bit_of.size(); i++) {
+                if (bit_of[i] == -1 || (mask & (1ull << bit_of[i])) == 0) {
+                    buffer.emplace_back(begin[i]);
+                }
+            }
+            // omitting everything would give a null production
+            if (buffer.empty()) {
                 continue;
             }
 
-            // find all rules where B is on the left side
-            char b = rule.second[0];
-            for (auto& r : g) {
-                if (r.first == b) {
-                    new_rules.emplace(rule.first, r.second);
-                }
+            g.add_rule(lhs, buffer);
+            if (!emitted.insert(g.rule_count() - 1).second) {
+                g.remove_last_rule();
             }
-            finished = false;
         }
+    };
 
-        old_rules = new_rules;
-        new_rules.clear();
-    }
+    int next_helper = 1;
+    auto new_helper_symbol = [&]() {
+        string name;
+        do {
+            name = "H" + to_string(next_helper++);
+        } while (g.symbols.find(name) != -1);
+        return g.symbols.intern(name, false);
+    };
+
+    vector<Symbol> s;
+    for (int rule = 0; rule < old.rule_count(); rule++) {
+        // ignore null productions (N -> \)
+        if (old.rhs_size(rule) == 0) {
+            continue;
+        }
+
+        int nullable_count = (int)count_if(old.rhs_begin(rule), old.rhs_end(rule), [&nullable](Symbol x) {
+            return nullable[x];
+        });
+        if (nullable_count <= null_expansion_bound) {
+            expand_rule(old.lhs[rule], old.rhs_begin(rule), old.rhs_end(rule));
+            continue;
+        }
+
+        // too many variants, chain the rule through helper symbols first: X -> a H1, H1 -> b H2, ...,
+        // a helper is nullable if the whole suffix it stands for is nullable
+        s.assign(old.rhs_begin(rule), old.rhs_end(rule));
+        vector<bool> suffix_nullable(s.size() + 1, true);
+        for (int i = (int)s.size() - 1; i >= 0; i--) {
+            suffix_nullable[i] = suffix_nullable[i+1] && nullable[s[i]];
+        }
 
-    return vector<ProductionRule>(old_rules.begin(), old_rules.end());
+        Symbol lhs = old.lhs[rule];
+        for (int i = 0; i+2 < (int)s.size(); i++) {
+            Symbol helper = new_helper_symbol();
+            nullable.resize(g.symbols.size(), false);
+            nullable[helper] = suffix_nullable[i+1];
+
+            Symbol pair[2] = { s[i], helper };
+            expand_rule(lhs, pair, pair + 2);
+            lhs = helper;
+        }
+        expand_rule(lhs, s.data() + s.size() - 2, s.data() + s.size());
+    }
 }
 
-Grammar eliminate_useless_symbols(const Grammar &g) {
-    // find the set of accessible symbols
-    set<char> accessible_symbols;
-    accessible_symbols.insert('S');
+void eliminate_unit_productions(Grammar &g) {
+    INSTRUMENT_SCOPE("eliminate_unit_productions");
+    int n = g.symbols.size();
+    const RuleArena old = g.take_rules();
+    const SymbolIndex &rules = old.rules_by_lhs(n);
+    auto is_unit_production = [&g, &old](int rule) {
+        return old.rhs_size(rule) == 1 && !g.symbols.is_terminal(*old.rhs_begin(rule));
+    };
+
+    // unit productions (A -> B) form a graph over nonterminals, find its strongly connected
+    // components with an iterative Tarjan's algorithm; every symbol of a component derives the others
+    vector<int> component(n, -1), order(n, -1), lowlink(n, 0);
+    vector<bool> on_stack(n, false);
+    vector<Symbol> stack;
+    // stack of (symbol, position in its list of rules) replacing the recursion
+    vector<pair<Symbol, const int *>> calls;
+    int visited = 0, component_count = 0;
+
+    for (Symbol root = 0; root < n; root++) {
+        if (order[root] != -1) {
+            continue;
+        }
+        calls.emplace_back(root, rules.begin(root));
+        order[root] = lowlink[root] = visited++;
+        stack.emplace_back(root);
+        on_stack[root] = true;
 
-    for (bool finished = false; !finished; ) {
-        finished = true;
+        while (!calls.empty()) {
+            INSTRUMENT_COUNT("eliminate_unit_productions.component_iterations", 1);
+            Symbol v = calls.back().first;
+            const int *&edge = calls.back().second;
 
-        for (auto &rule : g) {
-            // skip if its not in the set of accessible symbols
-            if (accessible_symbols.count(rule.first) == 0) {
+            // advance to the next unit production of v
+            while (edge != rules.end(v) && !is_unit_production(*edge)) {
+                edge++;
+            }
+            if (edge != rules.end(v)) {
+                Symbol w = *old.rhs_begin(*edge++);
+                if (order[w] == -1) {
+                    order[w] = lowlink[w] = visited++;
+                    stack.emplace_back(w);
+                    on_stack[w] = true;
+                    calls.emplace_back(w, rules.begin(w));
+                } else if (on_stack[w]) {
+                    lowlink[v] = min(lowlink[v], order[w]);
+                }
                 continue;
             }
 
-            // update accessible set with symbols adjacent to the current rule
-            for (char c : rule.second) {
-                if (isupper(c) && accessible_symbols.count(c) == 0) {
-                    accessible_symbols.insert(c);
-                    finished = false;
-                }
+            // all successors are done, v may be the root of a component
+            calls.pop_back();
+            if (!calls.empty()) {
+                Symbol parent = calls.back().first;
+                lowlink[parent] = min(lowlink[parent], lowlink[v]);
+            }
+            if (lowlink[v] == order[v]) {
+                Symbol w;
+                do {
+                    w = stack.back();
+                    stack.pop_back();
+                    on_stack[w] = false;
+                    component[w] = component_count;
+                } while (w != v);
+                component_count++;
             }
         }
     }
 
-    // find the set of productive symbols
-    set<char> productive_symbols;
-
-    // define predicate of a productive symbol
-    auto is_symbol_productive = [&productive_symbols](char c){ return islower(c) || productive_symbols.count(c) != 0; };
+    // components are numbered in reverse topological order, so closures of the successors
+    // are ready when a component is processed; each closure is a bitset row over components
+    SymbolIndex members;
+    members.offsets.assign(component_count + 1, 0);
+    for (Symbol s = 0; s < n; s++) {
+        members.offsets[component[s] + 1]++;
+    }
+    for (int c = 0; c < component_count; c++) {
+        members.offsets[c+1] += members.offsets[c];
+    }
+    members.rules.resize(n);
+    vector<int> position(members.offsets.begin(), members.offsets.end() - 1);
+    for (Symbol s = 0; s < n; s++) {
+        members.rules[position[component[s]]++] = s;
+    }
 
-    for (bool finished = false; !finished; ) {
-        finished = true;
+    // only components touched by unit productions need a row, the rest derive only themselves
+    vector<int> row_of(component_count, -1);
+    int row_count = 0;
+    for (int rule = 0; rule < old.rule_count(); rule++) {
+        if (is_unit_production(rule)) {
+            for (Symbol s : { old.lhs[rule], *old.rhs_begin(rule) }) {
+                if (row_of[component[s]] == -1) {
+                    row_of[component[s]] = row_count++;
+                }
+            }
+        }
+    }
 
-        for (auto &rule : g) {
-            bool is_productive = all_of(rule.second.begin(), rule.second.end(), is_symbol_productive);
+    size_t words = ((size_t)component_count + 63) / 64;
+    vector<uint64_t> closure((size_t)row_count * words, 0);
+    for (int c = 0; c < component_count; c++) {
+        if (row_of[c] == -1) {
+            continue;
+        }
+        INSTRUMENT_COUNT("eliminate_unit_productions.closure_iterations", 1);
+        uint64_t *row = &closure[(size_t)row_of[c] * words];
+        row[c / 64] |= 1ull << (c % 64);
 
-            if (is_productive && productive_symbols.count(rule.first) == 0) {
-                productive_symbols.insert(rule.first);
-                finished = false;
+        for (const int *v = members.begin(c); v != members.end(c); v++) {
+            for (const int *rule = rules.begin(*v); rule != rules.end(*v); rule++) {
+                if (!is_unit_production(*rule)) {
+                    continue;
+                }
+                int target = component[*old.rhs_begin(*rule)];
+                if (target != c) {
+                    const uint64_t *successor = &closure[(size_t)row_of[target] * words];
+                    for (size_t i = 0; i < words; i++) {
+                        row[i] |= successor[i];
+                    }
+                }
             }
         }
     }
 
-    // filter production rules using calculated sets
-    vector<ProductionRule> new_rules;
-    for (auto &rule : g) {
-        // if its left side symbol is inaccessible, skip it
-        if (accessible_symbols.count(rule.first) == 0) {
+    // every nonterminal receives non-unit productions of all nonterminals it derives
+    // through unit productions, sorted and without duplicates
+    auto rhs_less = [&old](int a, int b) {
+        return lexicographical_compare(old.rhs_begin(a), old.rhs_end(a), old.rhs_begin(b), old.rhs_end(b));
+    };
+    auto rhs_equal = [&old](int a, int b) {
+        return equal(old.rhs_begin(a), old.rhs_end(a), old.rhs_begin(b), old.rhs_end(b));
+    };
+
+    vector<int> candidates;
+    for (Symbol a = 0; a < n; a++) {
+        if (g.symbols.is_terminal(a)) {
             continue;
         }
 
-        // if contains nonproductive symbols on its right side, skip it
-        if (!all_of(rule.second.begin(), rule.second.end(), is_symbol_productive)) {
-            continue;
+        candidates.clear();
+        auto collect = [&](Symbol b) {
+            for (const int *rule = rules.begin(b); rule != rules.end(b); rule++) {
+                if (!is_unit_production(*rule)) {
+                    candidates.emplace_back(*rule);
+                }
+            }
+        };
+
+        int c = component[a];
+        if (row_of[c] == -1) {
+            collect(a);
+        } else {
+            const uint64_t *row = &closure[(size_t)row_of[c] * words];
+            for (size_t i = 0; i < words; i++) {
+                for (uint64_t bits = row[i]; bits != 0; bits &= bits - 1) {
+                    int reached = (int)(i * 64 + __builtin_ctzll(bits));
+                    for (const int *b = members.begin(reached); b != members.end(reached); b++) {
+                        collect(*b);
+                    }
+                }
+            }
         }
 
-        new_rules.emplace_back(rule);
+        sort(candidates.begin(), candidates.end(), rhs_less);
+        candidates.erase(unique(candidates.begin(), candidates.end(), rhs_equal), candidates.end());
+        for (int rule : candidates) {
+            g.add_rule(a, old.rhs_begin(rule), old.rhs_end(rule));
+        }
     }
+}
+
+void eliminate_useless_symbols(Grammar &g) {
+    INSTRUMENT_SCOPE("eliminate_useless_symbols");
+    // find the sets of accessible and productive symbols
+    int accessible_iterations, productive_iterations;
+    vector<bool> accessible_symbols = find_accessible_symbols(g, accessible_iterations);
+    vector<bool> productive_symbols = find_productive_symbols(g, productive_iterations);
+    INSTRUMENT_COUNT("eliminate_useless_symbols.accessible_iterations", accessible_iterations);
+    INSTRUMENT_COUNT("eliminate_useless_symbols.productive_iterations", productive_iterations);
+
+    // define predicate of a productive symbol
+    auto is_symbol_productive = [&productive_symbols](Symbol s) { return productive_symbols[s]; };
+
+    // filter production rules using calculated sets
+    g.retain_rules([&](int rule) {
+        // if its left side symbol is inaccessible, skip it
+        if (!accessible_symbols[g.lhs[rule]]) {
+            return false;
+        }
 
-    return new_rules;
+        // if contains nonproductive symbols on its right side, skip it
+        return all_of(g.rhs_begin(rule), g.rhs_end(rule), is_symbol_productive);
+    });
 }
 
-Grammar transform_into_cnf(const Grammar &g) {
-    // find letters that are used in at least one production rule
-    set<int> used_letters;
-    for (auto &rule : g) {
-        used_letters.insert(rule.first);
+void transform_into_cnf(Grammar &g) {
+    INSTRUMENT_SCOPE("transform_into_cnf");
+    const RuleArena old = g.take_rules();
+
+    // find symbols that are used in at least one production rule
+    vector<bool> used_symbols(g.symbols.size(), false);
+    for (int rule = 0; rule < old.rule_count(); rule++) {
+        used_symbols[old.lhs[rule]] = true;
+        for (const Symbol *s = old.rhs_begin(rule); s != old.rhs_end(rule); s++) {
+            used_symbols[*s] = true;
+        }
     }
 
-    // define a production that will give us next available variable
-    auto next_unused_symbol = [&used_letters]() -> char {
-        char x = 'A';
-        for (; x <= 'Z' && used_letters.count(x) != 0; x++);
-        used_letters.insert(x);
-        return x;
+    // define a production that will give us next available variable: unused
+    // letters are taken first, then numbered names are generated
+    int next_letter = 'A', next_number = 1;
+    auto next_unused_symbol = [&]() -> Symbol {
+        while (true) {
+            string name = next_letter <= 'Z' ? string(1, (char)next_letter++) : "N" + to_string(next_number++);
+            Symbol s = g.symbols.find(name);
+            if (s == -1 || (s < (int)used_symbols.size() && !used_symbols[s])) {
+                return g.symbols.intern(name, false);
+            }
+        }
     };
 
     // transform all production rules to these formats: A -> BC, A -> a
-    vector<ProductionRule> new_rules;
-    map<char, char> symbol_mapping;
-    for (auto &rule : g) {
+    map<Symbol, Symbol> symbol_mapping;
+    for (int rule = 0; rule < old.rule_count(); rule++) {
 
-        // if it's a terminal character, no need to transform anything
-        if (rule.second.size() == 1) {
-            new_rules.emplace_back(rule);
+        // if it's a terminal symbol, no need to transform anything
+        if (old.rhs_size(rule) == 1) {
+            g.add_rule(old.lhs[rule], old.rhs_begin(rule), old.rhs_end(rule));
             continue;
         }
 
         // rename terminal symbols
-        string s = rule.second;
-        for (char &c : s) {
+        vector<Symbol> s(old.rhs_begin(rule), old.rhs_end(rule));
+        for (Symbol &c : s) {
             // get a new name for it
-            if (islower(c)) {
+            if (g.symbols.is_terminal(c)) {
                 if (symbol_mapping.count(c) == 0) {
                     symbol_mapping[c] = next_unused_symbol();
                 }
@@ -283,27 +987,717 @@ Grammar transform_into_cnf(const Grammar &g) {
 
         // if it contains only 2 symbols, no need for rule chaining
         if (s.size() == 2) {
-            new_rules.emplace_back(rule.first, s);
+            g.add_rule(old.lhs[rule], s);
             continue;
         }
 
         // chain from the back to the front
-        char last = next_unused_symbol();
-        new_rules.emplace_back(last, s.substr(s.size()-2));
+        Symbol last = next_unused_symbol();
+        g.add_rule(last, { s[s.size()-2], s[s.size()-1] });
 
         for (int i = (int)s.size()-2-1; i > 0; i--) {
-            char pr = next_unused_symbol();
-            new_rules.emplace_back(pr, string(1, s[i]) + string(1, last));
+            Symbol pr = next_unused_symbol();
+            g.add_rule(pr, { s[i], last });
             last = pr;
         }
 
-        new_rules.emplace_back(rule.first, string(1, s[0]) + string(1, last));
+        g.add_rule(old.lhs[rule], { s[0], last });
     }
 
     // adding production rules for newly created symbols
     for (auto &p : symbol_mapping) {
-        new_rules.emplace_back(p.second, string(1, p.first));
+        g.add_rule(p.second, { p.first });
     }
+}
 
-    return new_rules;
+long peak_memory_kb() {
+    // VmHWM is the peak resident set size, which reset_peak_memory can reset on Linux
+    FILE *status = fopen("/proc/self/status", "r");
+    if (status != nullptr) {
+        char line[256];
+        long value = -1;
+        while (fgets(line, sizeof(line), status)) {
+            if (sscanf(line, "VmHWM: %ld", &value) == 1) {
+                break;
+            }
+        }
+        fclose(status);
+        if (value != -1) {
+            return value;
+        }
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+void reset_peak_memory() {
+    // not available everywhere, then peaks accumulate over the whole run
+    FILE *clear_refs = fopen("/proc/self/clear_refs", "w");
+    if (clear_refs != nullptr) {
+        fputs("5", clear_refs);
+        fclose(clear_refs);
+    }
+}
+
+CykParser::CykParser(const Grammar &_g) : g(_g) {
+    bit_of.assign(g.symbols.size(), -1);
+    for (Symbol s = 0; s < g.symbols.size(); s++) {
+        if (!g.symbols.is_terminal(s)) {
+            bit_of[s] = nonterminal_count++;
+            symbol_of.emplace_back(s);
+        }
+    }
+    words = ((size_t)nonterminal_count + 63) / 64;
+
+    auto new_bitset = [this]() {
+        heads.resize(heads.size() + words, 0);
+        return heads.size() - words;
+    };
+
+    right_masks.assign((size_t)nonterminal_count * words, 0);
+    pair_heads.assign(nonterminal_count, vector<pair<int, size_t>>());
+    terminal_heads.assign(g.symbols.size(), -1);
+
+    map<pair<int, int>, size_t> pair_offsets;
+    for (int rule = 0; rule < g.rule_count(); rule++) {
+        int a = bit_of[g.lhs[rule]];
+        const Symbol *rhs = g.rhs_begin(rule);
+
+        if (g.rhs_size(rule) == 1 && g.symbols.is_terminal(rhs[0])) {
+            if (terminal_heads[rhs[0]] == -1) {
+                terminal_heads[rhs[0]] = (long long)new_bitset();
+            }
+            heads[terminal_heads[rhs[0]] + a / 64] |= 1ull << (a % 64);
+        } else if (g.rhs_size(rule) == 2 && bit_of[rhs[0]] != -1 && bit_of[rhs[1]] != -1) {
+            int b = bit_of[rhs[0]], c = bit_of[rhs[1]];
+            right_masks[(size_t)b * words + c / 64] |= 1ull << (c % 64);
+
+            auto it = pair_offsets.find({ b, c });
+            if (it == pair_offsets.end()) {
+                it = pair_offsets.emplace(make_pair(b, c), new_bitset()).first;
+                pair_heads[b].emplace_back(c, it->second);
+            }
+            heads[it->second + a / 64] |= 1ull << (a % 64);
+        }
+        // rules of other shapes are not in Chomsky normal form and can't be used
+    }
+    for (auto &pairs : pair_heads) {
+        sort(pairs.begin(), pairs.end());
+    }
+}
+
+const uint64_t* CykParser::heads_of(int b, int c) const {
+    const vector<pair<int, size_t>> &pairs = pair_heads[b];
+    auto it = lower_bound(pairs.begin(), pairs.end(), make_pair(c, (size_t)0));
+    return &heads[it->second];
+}
+
+void CykParser::fill_cell(int i, int l) {
+    uint64_t *out = cell(i, l);
+    fill(out, out + words, 0);
+
+    for (int k = 1; k < l; k++) {
+        const uint64_t *x = cell(i, k), *y = cell(i+k, l-k);
+
+        for (size_t xw = 0; xw < words; xw++) {
+            for (uint64_t xbits = x[xw]; xbits != 0; xbits &= xbits - 1) {
+                int b = (int)(xw * 64 + __builtin_ctzll(xbits));
+                const uint64_t *mask = &right_masks[(size_t)b * words];
+
+                // nonterminals C of the right part that form some rule A -> BC
+                for (size_t yw = 0; yw < words; yw++) {
+                    for (uint64_t ybits = y[yw] & mask[yw]; ybits != 0; ybits &= ybits - 1) {
+                        int c = (int)(yw * 64 + __builtin_ctzll(ybits));
+                        const uint64_t *a = heads_of(b, c);
+                        for (size_t w = 0; w < words; w++) {
+                            out[w] |= a[w];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+bool CykParser::recognize(const vector<Symbol> &word, int threads) {
+    INSTRUMENT_SCOPE("CykParser::recognize");
+    input = word;
+    length = (int)word.size();
+    if (length == 0 || g.start == -1 || bit_of[g.start] == -1) {
+        length = 0;
+        return false;
+    }
+
+    length_offsets.assign(length + 2, 0);
+    for (int l = 1; l <= length; l++) {
+        length_offsets[l+1] = length_offsets[l] + (length - l + 1);
+    }
+    table.assign(length_offsets[length+1] * words, 0);
+
+    for (int i = 0; i < length; i++) {
+        if (word[i] == -1 || terminal_heads[word[i]] == -1) {
+            length = 0;
+            return false;
+        }
+        const uint64_t *a = &heads[terminal_heads[word[i]]];
+        copy(a, a + words, cell(i, 1));
+    }
+
+    // cells of one anti-diagonal (same length) only depend on shorter ones
+    threads = max(1, min(threads, length / 16));
+    if (threads == 1) {
+        for (int l = 2; l <= length; l++) {
+            for (int i = 0; i + l <= length; i++) {
+                fill_cell(i, l);
+            }
+        }
+    } else {
+        Barrier barrier(threads);
+        auto worker = [&](int id) {
+            for (int l = 2; l <= length; l++) {
+                for (int i = id; i + l <= length; i += threads) {
+                    fill_cell(i, l);
+                }
+                barrier.wait();
+            }
+        };
+
+        vector<thread> pool;
+        for (int id = 0; id < threads; id++) {
+            pool.emplace_back(worker, id);
+        }
+        for (thread &t : pool) {
+            t.join();
+        }
+    }
+
+    int s = bit_of[g.start];
+    return (cell(0, length)[s / 64] >> (s % 64)) & 1;
+}
+
+ParseForest CykParser::build_forest() const {
+    ParseForest forest;
+    if (length == 0) {
+        return forest;
+    }
+
+    // nodes are discovered from the root, identified by (span length, start, nonterminal bit)
+    unordered_map<uint64_t, int> node_ids;
+    auto node_of = [&](int a, int i, int l) {
+        uint64_t key = ((uint64_t)l * (length + 1) + i) * nonterminal_count + a;
+        auto it = node_ids.find(key);
+        if (it != node_ids.end()) {
+            return it->second;
+        }
+        int id = (int)forest.nodes.size();
+        forest.nodes.push_back({ symbol_of[a], i, l, 0, 0 });
+        node_ids.emplace(key, id);
+        return id;
+    };
+
+    node_of(bit_of[g.start], 0, length);
+    for (int id = 0; id < (int)forest.nodes.size(); id++) {
+        int a = bit_of[forest.nodes[id].symbol], i = forest.nodes[id].begin, l = forest.nodes[id].length;
+        forest.nodes[id].first_packed = (int)forest.packed.size();
+
+        for (int k = 1; k < l; k++) {
+            const uint64_t *x = cell(i, k), *y = cell(i+k, l-k);
+            for (size_t xw = 0; xw < words; xw++) {
+                for (uint64_t xbits = x[xw]; xbits != 0; xbits &= xbits - 1) {
+                    int b = (int)(xw * 64 + __builtin_ctzll(xbits));
+                    const uint64_t *mask = &right_masks[(size_t)b * words];
+                    for (size_t yw = 0; yw < words; yw++) {
+                        for (uint64_t ybits = y[yw] & mask[yw]; ybits != 0; ybits &= ybits - 1) {
+                            int c = (int)(yw * 64 + __builtin_ctzll(ybits));
+                            if ((heads_of(b, c)[a / 64] >> (a % 64)) & 1) {
+                                int left = node_of(b, i, k);
+                                int right = node_of(c, i+k, l-k);
+                                forest.packed.emplace_back(left, right);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        forest.nodes[id].packed_count = (int)forest.packed.size() - forest.nodes[id].first_packed;
+    }
+
+    // children always span less than their parent, so shorter nodes are counted first
+    vector<int> order(forest.nodes.size());
+    for (int id = 0; id < (int)order.size(); id++) {
+        order[id] = id;
+    }
+    sort(order.begin(), order.end(), [&forest](int a, int b) {
+        return forest.nodes[a].length < forest.nodes[b].length;
+    });
+
+    vector<double> trees(forest.nodes.size(), 0);
+    for (int id : order) {
+        const ParseForest::Node &node = forest.nodes[id];
+        if (node.length == 1) {
+            trees[id] = 1;
+        }
+        for (int p = node.first_packed; p < node.first_packed + node.packed_count; p++) {
+            trees[id] += trees[forest.packed[p].first] * trees[forest.packed[p].second];
+        }
+    }
+    forest.trees = trees[0];
+    return forest;
+}
+
+void CykParser::show_tree(const ParseForest &forest, int node, string &out) const {
+    // shows the first derivation of the node in bracketed form, like S(A(a) B(b))
+    if (node >= (int)forest.nodes.size()) {
+        return;
+    }
+    const ParseForest::Node &n = forest.nodes[node];
+    const string &name = g.symbols.name(n.symbol);
+    out += name.size() == 1 ? name : "<" + name + ">";
+    out += '(';
+
+    if (n.packed_count == 0) {
+        out += g.symbols.name(input[n.begin]);
+    } else {
+        const pair<int, int> &children = forest.packed[n.first_packed];
+        show_tree(forest, children.first, out);
+        out += ' ';
+        show_tree(forest, children.second, out);
+    }
+    out += ')';
+}
+
+
+EarleyParser::EarleyParser(const Grammar &_g) : g(_g) {
+    int nullable_iterations;
+    nullable = find_nullable_symbols(g, nullable_iterations);
+    INSTRUMENT_COUNT("EarleyParser.nullable_iterations", nullable_iterations);
+
+    for (int rule = 0; rule < g.rule_count(); rule++) {
+        rule_positions.emplace_back((int)next_symbol.size());
+        next_symbol.insert(next_symbol.end(), g.rhs_begin(rule), g.rhs_end(rule));
+        next_symbol.emplace_back(-1);
+        position_lhs.insert(position_lhs.end(), g.rhs_size(rule) + 1, g.lhs[rule]);
+    }
+    rule_positions.emplace_back((int)next_symbol.size());
+
+    // S' -> S, the only complete item of it with origin 0 accepts the input
+    next_symbol.emplace_back(g.start);
+    next_symbol.emplace_back(-1);
+    position_lhs.insert(position_lhs.end(), 2, -1);
+    accept_position = rule_positions.back() + 1;
+}
+
+int EarleyParser::leo_item(int column, Symbol symbol) {
+    // follows the path while every column has a single item waiting for the symbol and the
+    // symbol is the last one of its rule, then fills the memo from the top of the path down
+    vector<pair<uint64_t, Item>> path;
+    int top = -1;
+    while (true) {
+        uint64_t key = column_key(column, symbol);
+        auto found = leo_index.find(key);
+        if (found != leo_index.end()) {
+            top = found->second;
+            break;
+        }
+
+        auto begin = waiting.begin() + waiting_offsets[column], end = waiting.begin() + waiting_offsets[column+1];
+        auto range = equal_range(begin, end, make_pair(symbol, -1), [](const pair<Symbol, int> &a, const pair<Symbol, int> &b) {
+            return a.first < b.first;
+        });
+        Item waiting_item = items[range.first == range.second ? 0 : range.first->second];
+        if (range.second - range.first != 1 || next_symbol[waiting_item.position + 1] != -1) {
+            leo_index.emplace(key, -1);
+            break;
+        }
+
+        // a cycle of unit rules: the reduction is not deterministic, complete the usual way
+        bool cycle = false;
+        for (auto &step : path) {
+            cycle = cycle || step.first == key;
+        }
+        if (cycle) {
+            for (auto &step : path) {
+                leo_index[step.first] = -1;
+            }
+            return -1;
+        }
+
+        Item completed = { waiting_item.position + 1, waiting_item.origin };
+        path.emplace_back(key, completed);
+        symbol = position_lhs[completed.position];
+        column = completed.origin;
+        if (symbol == -1) {
+            break;
+        }
+    }
+
+    for (int step = (int)path.size() - 1; step >= 0; step--) {
+        Item top_item = top == -1 ? path[step].second : leo_items[top].top;
+        leo_items.push_back({ top_item, path[step].second });
+        top = (int)leo_items.size() - 1;
+        leo_index[path[step].first] = top;
+    }
+    return top;
+}
+
+void EarleyParser::add_span(Symbol symbol, int begin, int end) {
+    if (symbol == -1) {
+        return;
+    }
+    if (spans.insert(span_key(symbol, begin, end)).second) {
+        span_begins[column_key(end, symbol)].emplace_back(begin);
+    }
+}
+
+bool EarleyParser::recognize(const vector<Symbol> &word, bool with_forest) {
+    INSTRUMENT_SCOPE("EarleyParser::recognize");
+    input = word;
+    keep_spans = with_forest;
+    int n = (int)input.size();
+    items.clear();
+    waiting.clear();
+    column_offsets.assign(1, 0);
+    waiting_offsets.assign(1, 0);
+    leo_index.clear();
+    leo_items.clear();
+    spans.clear();
+    span_begins.clear();
+    if (g.start == -1) {
+        return false;
+    }
+
+    unordered_set<uint64_t> seen;
+    auto add_item = [&](int position, int origin) {
+        if (seen.insert((uint64_t)position * (n + 1) + origin).second) {
+            items.push_back({ position, origin });
+        }
+    };
+    vector<Item> scanned = { { rule_positions.back(), 0 } };
+
+    for (int column = 0; column <= n; column++) {
+        seen.clear();
+        for (const Item &item : scanned) {
+            add_item(item.position, item.origin);
+        }
+        scanned.clear();
+
+        for (size_t index = column_offsets[column]; index < items.size(); index++) {
+            Item item = items[index];
+            Symbol symbol = next_symbol[item.position];
+
+            if (symbol == -1) {
+                Symbol completed = position_lhs[item.position];
+                if (keep_spans) {
+                    add_span(completed, item.origin, column);
+                }
+                // completions of empty spans are done by predicting past nullable symbols
+                if (item.origin == column || completed == -1) {
+                    continue;
+                }
+
+                int leo = leo_item(item.origin, completed);
+                if (leo != -1) {
+                    add_item(leo_items[leo].top.position, leo_items[leo].top.origin);
+                    // symbols skipped along the path are still needed to build the forest
+                    for (int step = leo; keep_spans && step != -1; ) {
+                        Item skipped = leo_items[step].first;
+                        add_span(position_lhs[skipped.position], skipped.origin, column);
+                        Symbol lhs = position_lhs[skipped.position];
+                        auto next = leo_index.find(column_key(skipped.origin, lhs));
+                        step = lhs == -1 || next == leo_index.end() ? -1 : next->second;
+                    }
+                    continue;
+                }
+
+                auto begin = waiting.begin() + waiting_offsets[item.origin];
+                auto end = waiting.begin() + waiting_offsets[item.origin + 1];
+                auto first = lower_bound(begin, end, make_pair(completed, -1));
+                for (auto it = first; it != end && it->first == completed; it++) {
+                    add_item(items[it->second].position + 1, items[it->second].origin);
+                }
+            } else if (g.symbols.is_terminal(symbol)) {
+                if (column < n && input[column] == symbol) {
+                    scanned.push_back({ item.position + 1, item.origin });
+                }
+            } else {
+                const SymbolIndex &rules = g.rules_by_lhs();
+                for (const int *rule = rules.begin(symbol); rule != rules.end(symbol); rule++) {
+                    add_item(rule_positions[*rule], column);
+                }
+                if (nullable[symbol]) {
+                    add_item(item.position + 1, item.origin);
+                }
+            }
+        }
+
+        column_offsets.emplace_back(items.size());
+        for (size_t index = column_offsets[column]; index < items.size(); index++) {
+            Symbol symbol = next_symbol[items[index].position];
+            if (symbol != -1 && !g.symbols.is_terminal(symbol)) {
+                waiting.emplace_back(symbol, (int)index);
+            }
+        }
+        sort(waiting.begin() + waiting_offsets[column], waiting.end());
+        waiting_offsets.emplace_back(waiting.size());
+
+        if (column < n && scanned.empty()) {
+            return false;
+        }
+    }
+
+    for (size_t index = column_offsets[n]; index < items.size(); index++) {
+        if (items[index].position == accept_position && items[index].origin == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+ParseForest EarleyParser::build_forest() const {
+    ParseForest forest;
+    int n = (int)input.size();
+    if (!keep_spans || spans.count(span_key(g.start, 0, n)) == 0) {
+        return forest;
+    }
+
+    // symbol nodes are created for every recognized span reachable from the root, before
+    // the derivations linking them are searched
+    unordered_map<uint64_t, int> symbol_nodes;
+    auto symbol_node = [&](Symbol symbol, int begin, int end) {
+        uint64_t key = span_key(symbol, begin, end);
+        auto it = symbol_nodes.find(key);
+        if (it != symbol_nodes.end()) {
+            return it->second;
+        }
+        int id = (int)forest.nodes.size();
+        forest.nodes.push_back({ symbol, begin, end - begin, 0, 0 });
+        symbol_nodes.emplace(key, id);
+        return id;
+    };
+    // the child deriving the whole span from a symbol, or -1 when there is none
+    auto span_child = [&](Symbol symbol, int begin, int end) {
+        if (g.symbols.is_terminal(symbol)) {
+            return end == begin + 1 && input[begin] == symbol ? -2 - begin : -1;
+        }
+        return spans.count(span_key(symbol, begin, end)) ? symbol_node(symbol, begin, end) : -1;
+    };
+    auto is_rule_start = [this](int position) {
+        return binary_search(rule_positions.begin(), rule_positions.end(), position);
+    };
+
+    // derivations of the first d >= 2 symbols of a rule over a span: the position is the
+    // dotted rule after them, the left child derives d-1 symbols and the right one the last
+    unordered_map<uint64_t, int> prefix_nodes;
+    function<int(int, int, int)> prefix_node;
+    auto prefix_families = [&](int position, int begin, int end, vector<pair<int, int>> &families) {
+        Symbol last = next_symbol[position - 1];
+        vector<int> splits;
+        if (g.symbols.is_terminal(last)) {
+            if (end > begin && input[end-1] == last) {
+                splits.emplace_back(end - 1);
+            }
+        } else {
+            auto it = span_begins.find(column_key(end, last));
+            if (it != span_begins.end()) {
+                for (int split : it->second) {
+                    if (split >= begin) {
+                        splits.emplace_back(split);
+                    }
+                }
+            }
+        }
+
+        for (int split : splits) {
+            int left = is_rule_start(position - 2) ? span_child(next_symbol[position - 2], begin, split)
+                                                   : prefix_node(position - 1, begin, split);
+            int right = left == -1 ? -1 : span_child(last, split, end);
+            if (right != -1) {
+                families.emplace_back(left, right);
+            }
+        }
+    };
+    prefix_node = [&](int position, int begin, int end) {
+        uint64_t key = ((uint64_t)position * (n + 1) + begin) * (n + 1) + end;
+        auto it = prefix_nodes.find(key);
+        if (it != prefix_nodes.end()) {
+            return it->second;
+        }
+        vector<pair<int, int>> families;
+        prefix_families(position, begin, end, families);
+        int id = -1;
+        if (!families.empty()) {
+            id = (int)forest.nodes.size();
+            forest.nodes.push_back({ -1, begin, end - begin, (int)forest.packed.size(), (int)families.size() });
+            forest.packed.insert(forest.packed.end(), families.begin(), families.end());
+        }
+        prefix_nodes.emplace(key, id);
+        return id;
+    };
+
+    symbol_node(g.start, 0, n);
+    const SymbolIndex &rules = g.rules_by_lhs();
+    for (int id = 0; id < (int)forest.nodes.size(); id++) {
+        if (forest.nodes[id].symbol == -1) {
+            continue;
+        }
+        Symbol symbol = forest.nodes[id].symbol;
+        int begin = forest.nodes[id].begin, end = begin + forest.nodes[id].length;
+
+        vector<pair<int, int>> families;
+        for (const int *rule = rules.begin(symbol); rule != rules.end(symbol); rule++) {
+            int size = g.rhs_size(*rule);
+            if (size == 0) {
+                if (begin == end) {
+                    families.emplace_back(-1, -1);
+                }
+            } else if (size == 1) {
+                int child = span_child(*g.rhs_begin(*rule), begin, end);
+                if (child != -1) {
+                    families.emplace_back(child, -1);
+                }
+            } else {
+                prefix_families(rule_positions[*rule] + size, begin, end, families);
+            }
+        }
+        forest.nodes[id].first_packed = (int)forest.packed.size();
+        forest.nodes[id].packed_count = (int)families.size();
+        forest.packed.insert(forest.packed.end(), families.begin(), families.end());
+    }
+
+    forest.trees = count_trees(forest);
+    return forest;
+}
+
+void EarleyParser::show_tree(const ParseForest &forest, string &out) const {
+    if (forest.nodes.empty()) {
+        return;
+    }
+    vector<int> best = find_shortest_derivations(forest);
+
+    // prints a child of a packed node, intermediate nodes are flattened into their parent
+    function<void(int)> show_node = [&](int node) {
+        if (node <= -2) {
+            out += g.symbols.name(input[-2 - node]);
+            return;
+        }
+        const ParseForest::Node &n = forest.nodes[node];
+        const pair<int, int> &family = forest.packed[best[node]];
+        if (n.symbol == -1) {
+            show_node(family.first);
+            out += ' ';
+            show_node(family.second);
+            return;
+        }
+
+        const string &name = g.symbols.name(n.symbol);
+        out += name.size() == 1 ? name : "<" + name + ">";
+        out += '(';
+        if (family.first == -1) {
+            out += NULL_CHARACTER;
+        } else {
+            show_node(family.first);
+        }
+        if (family.second != -1) {
+            out += ' ';
+            show_node(family.second);
+        }
+        out += ')';
+    };
+    show_node(0);
+}
+
+double count_trees(const ParseForest &forest) {
+    if (forest.nodes.empty()) {
+        return 0;
+    }
+
+    // depth-first search over nodes, a node reached again while still open lies on a cycle
+    enum { unvisited, open, done };
+    vector<char> state(forest.nodes.size(), unvisited);
+    vector<double> trees(forest.nodes.size(), 0);
+    vector<int> stack = { 0 };
+    while (!stack.empty()) {
+        int node = stack.back();
+        const ParseForest::Node &n = forest.nodes[node];
+        if (state[node] == unvisited) {
+            state[node] = open;
+            for (int p = n.first_packed; p < n.first_packed + n.packed_count; p++) {
+                for (int child : { forest.packed[p].first, forest.packed[p].second }) {
+                    if (child < 0) {
+                        continue;
+                    }
+                    if (state[child] == open) {
+                        trees[child] = INFINITY;
+                    } else if (state[child] == unvisited) {
+                        stack.emplace_back(child);
+                    }
+                }
+            }
+            continue;
+        }
+        stack.pop_back();
+        if (state[node] == done) {
+            continue;
+        }
+        state[node] = done;
+
+        double total = n.packed_count == 0 ? 1 : 0;
+        for (int p = n.first_packed; p < n.first_packed + n.packed_count; p++) {
+            double product = 1;
+            for (int child : { forest.packed[p].first, forest.packed[p].second }) {
+                product *= child < 0 ? 1 : trees[child];
+            }
+            total += product;
+        }
+        trees[node] = trees[node] == INFINITY ? INFINITY : total;
+    }
+    return trees[0];
+}
+
+vector<int> find_shortest_derivations(const ParseForest &forest) {
+    // a packed node becomes usable once all its children have a derivation, nodes are
+    // finished in order of height as in Dijkstra's algorithm
+    vector<int> best(forest.nodes.size(), -1), pending(forest.packed.size(), 0), owner(forest.packed.size());
+    vector<int> height(forest.nodes.size(), 0);
+    vector<vector<int>> users(forest.nodes.size());
+    priority_queue<pair<int, int>, vector<pair<int, int>>, greater<pair<int, int>>> ready;
+
+    for (int node = 0; node < (int)forest.nodes.size(); node++) {
+        const ParseForest::Node &n = forest.nodes[node];
+        for (int p = n.first_packed; p < n.first_packed + n.packed_count; p++) {
+            owner[p] = node;
+            for (int child : { forest.packed[p].first, forest.packed[p].second }) {
+                if (child >= 0) {
+                    pending[p]++;
+                    users[child].emplace_back(p);
+                }
+            }
+            if (pending[p] == 0) {
+                ready.emplace(1, p);
+            }
+        }
+    }
+
+    while (!ready.empty()) {
+        auto [h, p] = ready.top();
+        ready.pop();
+        int node = owner[p];
+        if (best[node] != -1) {
+            continue;
+        }
+        best[node] = p;
+        height[node] = h;
+        for (int user : users[node]) {
+            if (--pending[user] == 0) {
+                int child_height = 0;
+                for (int child : { forest.packed[user].first, forest.packed[user].second }) {
+                    child_height = max(child_height, child < 0 ? 0 : height[child]);
+                }
+                ready.emplace(child_height + 1, user);
+            }
+        }
+    }
+    return best;
 }